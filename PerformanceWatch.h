@@ -0,0 +1,36 @@
+#pragma once
+// A stopwatch for timing the preview path. Built on boost::chrono's steady
+// clock, which is QueryPerformanceCounter on Windows, so it runs anywhere the
+// pipeline does.
+
+#include <boost/chrono.hpp>
+
+class CPerformanceWatch
+{
+public:
+	CPerformanceWatch()
+	{
+		Restart();
+	}
+
+	void Restart()
+	{
+		start_ = Clock::now();
+	}
+
+	// Elapsed milliseconds.
+	long long Now() const
+	{
+		return boost::chrono::duration_cast<boost::chrono::milliseconds>(Clock::now() - start_).count();
+	}
+	// Elapsed microseconds.
+	long long NowInMicro() const
+	{
+		return boost::chrono::duration_cast<boost::chrono::microseconds>(Clock::now() - start_).count();
+	}
+
+private:
+	typedef boost::chrono::steady_clock Clock;
+
+	Clock::time_point start_;
+};
@@ -7,21 +7,84 @@
 #include <iostream>
 #include <sstream>
 #include "markdown.h"
-#include <locale>
-#include <codecvt>
+#include "PreviewPipeline.h"
+#include "RefreshPolicy.h"
+#include "PerformanceWatch.h"
 
 using namespace std;
 
 extern CAppModule _Module;
 extern NppData nppData;
 
-class CPreviewDlg : public CAxDialogImpl<CPreviewDlg>
+// The Scintilla view Notepad++ currently has focused.
+class CScintillaBuffer : public IEditorBuffer
+{
+public:
+	virtual void GetText(std::string& text)
+	{
+		HWND curScintilla = GetCurrentScintilla();
+		text.clear();
+		if (!curScintilla)
+			return;
+		int len = ::SendMessage(curScintilla, SCI_GETTEXTLENGTH, 0, 0);
+		text.resize(len + 1);
+		::SendMessage(curScintilla, SCI_GETTEXT, len + 1, (LPARAM)&text[0]);
+		text.resize(len);
+	}
+
+	virtual int GetCodePage()
+	{
+		HWND curScintilla = GetCurrentScintilla();
+		if (!curScintilla)
+			return SC_CP_UTF8;
+		return (int)::SendMessage(curScintilla, SCI_GETCODEPAGE, 0, 0);
+	}
+
+	virtual void GetVisibleLines(size_t& first, size_t& last)
+	{
+		first = last = 0;
+		HWND curScintilla = GetCurrentScintilla();
+		if (!curScintilla)
+			return;
+		int firstVisible = (int)::SendMessage(curScintilla, SCI_GETFIRSTVISIBLELINE, 0, 0);
+		int onScreen = (int)::SendMessage(curScintilla, SCI_LINESONSCREEN, 0, 0);
+		first = (size_t)::SendMessage(curScintilla, SCI_DOCLINEFROMVISIBLE, firstVisible, 0);
+		last = (size_t)::SendMessage(curScintilla, SCI_DOCLINEFROMVISIBLE, firstVisible + onScreen, 0);
+	}
+
+	// Tells the documents apart for CRefreshPolicy: Notepad++'s buffer id,
+	// which NPPN_FILECLOSED gives back when the document goes away.
+	CRefreshPolicy::BufferKey GetDocumentKey()
+	{
+		return (CRefreshPolicy::BufferKey)::SendMessage(nppData._nppHandle, NPPM_GETCURRENTBUFFERID, 0, 0);
+	}
+
+	static HWND GetCurrentScintilla()
+	{
+		int which = -1;
+		::SendMessage(nppData._nppHandle, NPPM_GETCURRENTSCINTILLA, 0, (LPARAM)&which);
+		if (which == -1)
+			return NULL;
+		return (which == 0)?nppData._scintillaMainHandle:nppData._scintillaSecondHandle;
+	}
+};
+
+class CPreviewDlg : public CAxDialogImpl<CPreviewDlg>, public IPreviewSink
 {
 public:
 	enum { IDD = IDD__PREVIEW_DLG };
 
+	// Blocks the pipeline didn't render right away are filled in on timer
+	// ticks of at most cFillSliceMs each.
+	enum { cFillTimerId = 1, cFillIntervalMs = 10, cFillSliceMs = 30 };
+	// Live preview refreshes that CRefreshPolicy put off fire on this timer.
+	enum { cRefreshTimerId = 2 };
+
+	CPreviewDlg() : pipeline_(buffer_, *this), processingKey_(0), processingMs_(0) { }
+
 	BEGIN_MSG_MAP(CPreviewDlg)
 		MESSAGE_HANDLER(WM_INITDIALOG, OnInitDialog)
+		MESSAGE_HANDLER(WM_TIMER, OnTimer)
 		COMMAND_ID_HANDLER(IDOK, OnCloseCmd)
 		COMMAND_ID_HANDLER(IDCANCEL, OnCloseCmd)
 		COMMAND_ID_HANDLER(IDC_BUTTON_PREVIEW, OnPreviewCmd)
@@ -43,7 +106,7 @@ public:
 		return TRUE;
 	}
 
-	void SetBodyText(ATL::CString str)
+	void SetBodyText(LPCWSTR str)
 	{
 		//ATL::CString aa = html.GetCharSet();
 		////MessageBox(aa);
@@ -58,54 +121,105 @@ public:
 
 	LRESULT OnPreviewCmd(WORD /*wNotifyCode*/, WORD wID, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 	{
-		
+		// An explicit refresh redraws everything, changed or not.
+		pipeline_.Invalidate();
 		Tans();
 		return 0;
 	}
 
 	void Tans()
 	{
-		int which = -1;
-		::SendMessage(nppData._nppHandle, NPPM_GETCURRENTSCINTILLA, 0, (LPARAM)&which);
-		if (which == -1)
-			return ;
-		HWND curScintilla = (which == 0)?nppData._scintillaMainHandle:nppData._scintillaSecondHandle;
-		int len = ::SendMessage(curScintilla, SCI_GETTEXTLENGTH, 0, 0);
-		len += 1;
-		char* buf = new char[len];
-		memset(buf, '\0', sizeof(char)*len);
-		::SendMessage(curScintilla, SCI_GETTEXT, len, (LPARAM)buf);
-
-		string mdString = buf;
-		markdown::Document doc;
-		doc.read(mdString);
-		std::ostringstream stream;
-		doc.write(stream);
-		std::string aHtml =  stream.str();
-
-    USES_CONVERSION;
-    int codepage = (int)::SendMessage(curScintilla, SCI_GETCODEPAGE, 0, 0);
-    wstring wHtml;
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
-    switch (codepage)
-    {
-    case (int)SC_CHARSET_ANSI:
-    case (int)SC_CHARSET_GB2312:
-    case (int)936: // GBK
-      wHtml = A2W(aHtml.c_str());
-      break;
-    case (int)SC_CP_UTF8:
-      wHtml = myconv.from_bytes(aHtml);
-      break;
-      // ADD YOUR ENCODING HERE ...
-    default:
-      wHtml = _T("Not supported encoding (UTF8/GB2312/GBK/ANSI)");
-      break;
-    }
-
-    SetBodyText(wHtml.c_str());
-
-		delete[] buf;
+		KillTimer(cFillTimerId);
+		KillTimer(cRefreshTimerId);
+		CPerformanceWatch watch;
+		unsigned long sourceMisses = pipeline_.Counts().sourceMisses;
+		pipeline_.Refresh();
+		processingKey_ = buffer_.GetDocumentKey();
+		processingMs_ = watch.NowInMicro() / 1000.0;
+		// A refresh that found the text unchanged didn't render anything, so
+		// says nothing about what rendering costs. A document that's
+		// processed over several slices is recorded once it's done, at what
+		// all of them cost together.
+		bool rendered = (pipeline_.Counts().sourceMisses != sourceMisses);
+		if (rendered && !pipeline_.Processing())
+			policy_.RecordRender(processingKey_, processingMs_);
+		if (pipeline_.HasPending())
+			SetTimer(cFillTimerId, cFillIntervalMs);
+	}
+
+	// Live preview: refreshes now, or (re)starts the timer so the refresh
+	// happens once the edits pause, depending on what it has been costing.
+	void OnBufferModified()
+	{
+		CRefreshPolicy::Decision decision = policy_.OnModified(buffer_.GetDocumentKey());
+		if (decision.action == CRefreshPolicy::cRefreshNow)
+			Tans();
+		else
+			SetTimer(cRefreshTimerId, decision.delayMs);
+	}
+
+	// A closed document's render times are of no further use.
+	void OnBufferClosed(CRefreshPolicy::BufferKey buffer)
+	{
+		policy_.Forget(buffer);
+	}
+
+	LRESULT OnTimer(UINT /*uMsg*/, WPARAM wParam, LPARAM /*lParam*/, BOOL& bHandled)
+	{
+		if (wParam == cRefreshTimerId)
+		{
+			Tans();
+			return 0;
+		}
+		if (wParam != cFillTimerId)
+		{
+			bHandled = FALSE;
+			return 0;
+		}
+		bool processing = pipeline_.Processing();
+		CPerformanceWatch watch;
+		bool pending = pipeline_.FillPending(cFillSliceMs);
+		if (processing)
+		{
+			processingMs_ += watch.NowInMicro() / 1000.0;
+			if (!pipeline_.Processing())
+				policy_.RecordRender(processingKey_, processingMs_);
+		}
+		if (!pending)
+			KillTimer(cFillTimerId);
+		return 0;
+	}
+
+	// Shows or hides the render timings line, re-rendering so it appears
+	// (or goes) right away.
+	void ShowRenderStats(bool show)
+	{
+		if (pipeline_.ShowingStats() == show)
+			return;
+		pipeline_.ShowStats(show);
+		if (IsWindow())
+			Tans();
+	}
+
+	// IPreviewSink
+	virtual void SetBody(const std::wstring& body)
+	{
+		SetBodyText(body.c_str());
+	}
+
+	virtual void SetBlock(size_t block, const std::wstring& blockHtml)
+	{
+		html.SetElementHTML(CPreviewPipeline::BlockId(block).c_str(), blockHtml.c_str());
+	}
+
+	virtual void ScrollToBlock(size_t block)
+	{
+		html.ScrollToElement(CPreviewPipeline::BlockId(block).c_str());
+	}
+
+	virtual void SetStatus(const std::wstring& text)
+	{
+		html.SetElementHTML(CPreviewPipeline::StatusId(), text.c_str());
 	}
 
 	LRESULT OnCloseCmd(WORD /*wNotifyCode*/, WORD wID, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
@@ -148,4 +262,10 @@ public:
 
 	WTL::CString url_;
 	CXHtmlView html;
+
+	CScintillaBuffer buffer_;
+	CPreviewPipeline pipeline_;
+	CRefreshPolicy policy_;
+	CRefreshPolicy::BufferKey processingKey_;
+	double processingMs_;
 };
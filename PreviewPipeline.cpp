@@ -0,0 +1,405 @@
+#include "PreviewPipeline.h"
+#include "PerformanceWatch.h"
+#include "Scintilla.h"
+
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <locale>
+#include <codecvt>
+#include <boost/chrono.hpp>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace
+{
+	const wchar_t cUnsupportedEncoding[] = L"Not supported encoding (UTF8/GB2312/GBK/ANSI)";
+
+	typedef boost::chrono::steady_clock Clock;
+
+	// A size for people: bytes, KB or MB, whichever fits, to one decimal
+	// place, so a limit under a megabyte doesn't come out as "0 MB".
+	std::wstring FormatBytes(size_t bytes)
+	{
+		std::wostringstream text;
+		if (bytes < 1024)
+			text << bytes << L" bytes";
+		else if (bytes < 1024 * 1024)
+			text << std::fixed << std::setprecision(1) << bytes / 1024.0 << L" KB";
+		else
+			text << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024) << L" MB";
+		return text.str();
+	}
+}
+
+CPreviewPipeline::CPreviewPipeline(IEditorBuffer& buffer, IPreviewSink& sink)
+	: buffer_(buffer), sink_(sink), codepage_(SC_CP_UTF8), processing_(false), nextPending_(0), anchorBlock_(0),
+	showStats_(false), progressive_(true), sourceHash_(0), bodyHash_(0), shownOverBudget_(markdown::cWithinBudget)
+{
+	budget_.maxSourceBytes = cDefaultMaxSourceBytes;
+	budget_.maxProcessingMs = cDefaultMaxProcessingMs;
+	budget_.fallback = markdown::Budget::cPlainText;
+}
+
+void CPreviewPipeline::Refresh()
+{
+	CPerformanceWatch watch;
+	buffer_.GetText(text_);
+	int codepage = buffer_.GetCodePage();
+	stats_.Add(CRenderStats::cFetch, watch.NowInMicro());
+
+	// The fingerprints are of the bytes, so they only hold within one code page.
+	if (codepage != codepage_)
+		Invalidate();
+	codepage_ = codepage;
+
+	// Style changes, undo followed by redo and the like leave the text as it
+	// was; so does the preview.
+	unsigned long long sourceHash = Fingerprint(text_.data(), text_.size());
+	if (sourceHash == sourceHash_)
+	{
+		++counts_.sourceHits;
+		PublishStats();
+		return;
+	}
+	++counts_.sourceMisses;
+	sourceHash_ = sourceHash;
+
+	pending_.clear();
+	nextPending_ = 0;
+
+	doc_.reset(new markdown::Document);
+	doc_->budget(budget_);
+	doc_->read(text_);
+
+	// A big document is processed a slice at a time, so the editor doesn't
+	// freeze while it is; the preview keeps showing the last version until
+	// it's done.
+	processing_ = !doc_->step(Clock::now() + boost::chrono::milliseconds(cRefreshSliceMs));
+	if (processing_)
+	{
+		PublishStats();
+		return;
+	}
+	Publish();
+}
+
+void CPreviewPipeline::Publish()
+{
+	CPerformanceWatch watch;
+	size_t blocks = doc_->blockCount();
+
+	// The notice about the budget is part of the body, so it's only right if
+	// the body is published again when the document goes over it (or back).
+	if (doc_->overBudget() != shownOverBudget_)
+	{
+		bodyHash_ = 0;
+		blockHashes_.clear();
+		shownOverBudget_ = doc_->overBudget();
+	}
+	if (blocks <= cViewportMinBlocks)
+	{
+		blockHashes_.clear();
+		ResetStream();
+		doc_->write(stream_);
+		html_ = stream_.str();
+		unsigned long long bodyHash = Fingerprint(html_.data(), html_.size());
+		if (bodyHash == bodyHash_)
+		{
+			++counts_.blockHits;
+			stats_.Add(doc_->timings());
+			PublishStats();
+			return;
+		}
+		++counts_.blockMisses;
+		bodyHash_ = bodyHash;
+
+		watch.Restart();
+		if (!ToWide(html_, codepage_, wHtml_))
+			wHtml_ = cUnsupportedEncoding;
+		stats_.Add(CRenderStats::cEncode, watch.NowInMicro());
+		watch.Restart();
+		body_.clear();
+		AppendStatusElement(body_);
+		AppendBudgetNotice(body_);
+		body_ += wHtml_;
+		sink_.SetBody(body_);
+		stats_.Add(CRenderStats::cPublish, watch.NowInMicro());
+		stats_.Add(doc_->timings());
+		PublishStats();
+		return;
+	}
+	bodyHash_ = 0;
+
+	// Map the editor's visible lines to blocks.
+	size_t firstLine = 0, lastLine = 0;
+	buffer_.GetVisibleLines(firstLine, lastLine);
+	const markdown::SourceIndex& index = doc_->sourceIndex();
+	markdown::optional<size_t> firstHit = index.blockAtLine(firstLine);
+	markdown::optional<size_t> lastHit = index.blockAtLine(lastLine);
+	anchorBlock_ = firstHit ? *firstHit : 0;
+	size_t first = anchorBlock_ > cViewportMarginBlocks ? anchorBlock_ - cViewportMarginBlocks : 0;
+	size_t last = (std::min)(blocks, (lastHit ? *lastHit + 1 : 1) + cViewportMarginBlocks);
+
+	if (blockHashes_.size() == blocks)
+	{
+		// Same number of blocks as the placeholders already in the preview:
+		// update them in place, and only the ones that rendered differently.
+		long long encodeMicros = 0, publishMicros = 0;
+		for (size_t b = first; b < last; ++b)
+		{
+			if (!PublishBlock(b, encodeMicros, publishMicros))
+			{
+				Invalidate();
+				sink_.SetBody(cUnsupportedEncoding);
+				return;
+			}
+		}
+		stats_.Add(CRenderStats::cEncode, encodeMicros);
+		stats_.Add(CRenderStats::cPublish, publishMicros);
+	}
+	else
+	{
+		// Every block gets a placeholder. The visible ones are filled in now;
+		// in progressive mode the rest show their skeleton until FillPending()
+		// gets to them, otherwise they start out empty.
+		blockHashes_.assign(blocks, 0);
+		body_.clear();
+		AppendStatusElement(body_);
+		AppendBudgetNotice(body_);
+		long long encodeMicros = 0;
+		for (size_t b = 0; b < blocks; ++b)
+		{
+			body_ += L"<div id=\"";
+			body_ += BlockId(b);
+			body_ += L"\">";
+			bool visible = (b >= first && b < last);
+			if (visible || progressive_)
+			{
+				const std::string& html = visible ? RenderBlock(b) : RenderSkeleton(b);
+				watch.Restart();
+				if (!ToWide(html, codepage_, wHtml_))
+				{
+					Invalidate();
+					sink_.SetBody(cUnsupportedEncoding);
+					return;
+				}
+				encodeMicros += watch.NowInMicro();
+				blockHashes_[b] = Fingerprint(html.data(), html.size());
+				body_ += wHtml_;
+			}
+			body_ += L"</div>";
+		}
+		stats_.Add(CRenderStats::cEncode, encodeMicros);
+		watch.Restart();
+		sink_.SetBody(body_);
+		sink_.ScrollToBlock(anchorBlock_);
+		stats_.Add(CRenderStats::cPublish, watch.NowInMicro());
+	}
+	stats_.Add(doc_->timings());
+	PublishStats();
+
+	for (size_t b = last; b < blocks; ++b)
+		pending_.push_back(b);
+	for (size_t b = 0; b < first; ++b)
+		pending_.push_back(b);
+}
+
+bool CPreviewPipeline::FillPending(unsigned sliceMs)
+{
+	Clock::time_point end = Clock::now() + boost::chrono::milliseconds(sliceMs);
+	if (processing_)
+	{
+		processing_ = !doc_->step(end);
+		if (processing_)
+			return true;
+		Publish();
+		return HasPending();
+	}
+
+	bool filledAbove = false;
+	CPerformanceWatch watch;
+	long long encodeMicros = 0, publishMicros = 0;
+	while (HasPending() && Clock::now() < end)
+	{
+		size_t b = pending_[nextPending_++];
+		unsigned long blockMisses = counts_.blockMisses;
+		PublishBlock(b, encodeMicros, publishMicros);
+		if (b < anchorBlock_ && counts_.blockMisses != blockMisses)
+			filledAbove = true;
+	}
+
+	// Blocks filled in above the viewport push it down; keep the block the
+	// editor is showing in view.
+	if (filledAbove)
+		sink_.ScrollToBlock(anchorBlock_);
+
+	stats_.Add(CRenderStats::cFill, watch.NowInMicro());
+	PublishStats();
+
+	if (!HasPending())
+	{
+		pending_.clear();
+		nextPending_ = 0;
+		return false;
+	}
+	return true;
+}
+
+void CPreviewPipeline::ShowStats(bool show)
+{
+	if (show != showStats_)
+		Invalidate();
+	showStats_ = show;
+}
+
+void CPreviewPipeline::Invalidate()
+{
+	sourceHash_ = 0;
+	bodyHash_ = 0;
+	blockHashes_.clear();
+}
+
+unsigned long long CPreviewPipeline::Fingerprint(const void* data, size_t size, unsigned long long hash)
+{
+	// 64-bit FNV-1a.
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::wstring CPreviewPipeline::BlockId(size_t block)
+{
+	std::wostringstream id;
+	id << L"mdblock" << block;
+	return id.str();
+}
+
+bool CPreviewPipeline::ToWide(const std::string& html, int codepage, std::wstring& wHtml)
+{
+	switch (codepage)
+	{
+	case (int)SC_CHARSET_ANSI:
+	case (int)SC_CHARSET_GB2312:
+	case (int)936: // GBK
+		{
+#ifdef _WIN32
+			int len = ::MultiByteToWideChar(CP_ACP, 0, html.data(), (int)html.size(), NULL, 0);
+			wHtml.resize(len);
+			if (len > 0)
+				::MultiByteToWideChar(CP_ACP, 0, html.data(), (int)html.size(), &wHtml[0], len);
+#else
+			// No system ANSI code page to speak of; treat it as Latin-1.
+			wHtml.assign(html.begin(), html.end());
+			for (size_t i = 0; i < wHtml.size(); ++i)
+				wHtml[i] &= 0xFF;
+#endif
+			return true;
+		}
+	case (int)SC_CP_UTF8:
+		{
+			std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
+			wHtml = myconv.from_bytes(html);
+			return true;
+		}
+		// ADD YOUR ENCODING HERE ...
+	default:
+		return false;
+	}
+}
+
+const std::string& CPreviewPipeline::RenderBlock(size_t block)
+{
+	ResetStream();
+	doc_->write(stream_, block, block + 1);
+	html_ = stream_.str();
+	return html_;
+}
+
+const std::string& CPreviewPipeline::RenderSkeleton(size_t block)
+{
+	ResetStream();
+	doc_->writeSkeleton(stream_, block, block + 1);
+	html_ = stream_.str();
+	return html_;
+}
+
+void CPreviewPipeline::AppendStatusElement(std::wstring& body) const
+{
+	if (!showStats_)
+		return;
+	body += L"<div id=\"";
+	body += StatusId();
+	body += L"\" style=\"font: 11px monospace; color: #666; border-bottom: 1px solid #ccc\"></div>";
+}
+
+void CPreviewPipeline::AppendBudgetNotice(std::wstring& body) const
+{
+	markdown::OverBudget over = doc_->overBudget();
+	if (over == markdown::cWithinBudget)
+		return;
+
+	std::wostringstream notice;
+	notice << L"<div style=\"padding: 4px; background: #fff3cd; border: 1px solid #e0c060\">";
+	if (over == markdown::cOverMemoryBudget)
+		notice << L"This document is larger than the preview's limit of "
+			<< FormatBytes(budget_.maxSourceBytes);
+	else
+		notice << L"Formatting this document took longer than the preview's limit of "
+			<< budget_.maxProcessingMs / 1000.0 << L" s";
+	if (budget_.fallback == markdown::Budget::cHeadingsOnly)
+		notice << L", so only its headings are shown.";
+	else if (over == markdown::cOverMemoryBudget)
+		notice << L", so the beginning of it is shown as plain text.";
+	else
+		notice << L", so it is shown as plain text.";
+	notice << L"</div>";
+	body += notice.str();
+}
+
+void CPreviewPipeline::PublishStats()
+{
+	if (!showStats_)
+		return;
+	std::wostringstream status;
+	status << stats_.Summary()
+		<< L" | unchanged: " << counts_.sourceHits << L'/' << (counts_.sourceHits + counts_.sourceMisses)
+		<< L" sources, " << counts_.blockHits << L'/' << (counts_.blockHits + counts_.blockMisses)
+		<< L" outputs";
+	sink_.SetStatus(status.str());
+}
+
+bool CPreviewPipeline::PublishBlock(size_t block, long long& encodeMicros, long long& publishMicros)
+{
+	const std::string& html = RenderBlock(block);
+	unsigned long long hash = Fingerprint(html.data(), html.size());
+	if (hash == blockHashes_[block])
+	{
+		++counts_.blockHits;
+		return true;
+	}
+	++counts_.blockMisses;
+
+	CPerformanceWatch watch;
+	if (!ToWide(html, codepage_, wHtml_))
+		return false;
+	encodeMicros += watch.NowInMicro();
+	watch.Restart();
+	sink_.SetBlock(block, wHtml_);
+	publishMicros += watch.NowInMicro();
+	blockHashes_[block] = hash;
+	return true;
+}
+
+void CPreviewPipeline::ResetStream()
+{
+	stream_.str(std::string());
+	stream_.clear();
+}
@@ -0,0 +1,158 @@
+#pragma once
+// The preview path, from "the editor changed" to "the preview shows it":
+// fetch text, parse, render, encode, publish. It only talks to the editor and
+// the browser through the two small interfaces below, so it builds and runs
+// without Windows.
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "markdown.h"
+#include "RenderStats.h"
+
+// Where the Markdown comes from.
+class IEditorBuffer
+{
+public:
+	virtual ~IEditorBuffer() {}
+
+	// Replaces `text` with the whole buffer; the string is reused between
+	// calls, so implementations should write into it rather than swap.
+	virtual void GetText(std::string& text) = 0;
+	// A Scintilla code page (SC_CP_UTF8, SC_CHARSET_ANSI, ...).
+	virtual int GetCodePage() = 0;
+	// Document lines currently on screen, first to last inclusive.
+	virtual void GetVisibleLines(size_t& first, size_t& last) = 0;
+};
+
+// Where the HTML goes.
+class IPreviewSink
+{
+public:
+	virtual ~IPreviewSink() {}
+
+	virtual void SetBody(const std::wstring& html) = 0;
+	// Fills in the placeholder element CPreviewPipeline::BlockId(block).
+	virtual void SetBlock(size_t block, const std::wstring& html) = 0;
+	virtual void ScrollToBlock(size_t block) = 0;
+	// Fills in the element CPreviewPipeline::StatusId(); only called while
+	// the render timings are shown.
+	virtual void SetStatus(const std::wstring& text) = 0;
+};
+
+class CPreviewPipeline : private boost::noncopyable
+{
+public:
+	// Documents with more top-level blocks than this are shown viewport
+	// first: the blocks around the editor's visible lines are rendered right
+	// away, the rest by FillPending().
+	enum { cViewportMinBlocks = 200, cViewportMarginBlocks = 20 };
+
+	// Past these, the preview shows the document as plain text, with a note
+	// saying why, rather than holding up the editor.
+	enum { cDefaultMaxSourceBytes = 8 * 1024 * 1024, cDefaultMaxProcessingMs = 3000 };
+
+	// Refresh() processes the document for at most this long; whatever is
+	// left is done by FillPending(), and the preview only changes once the
+	// processing is finished.
+	enum { cRefreshSliceMs = 50 };
+
+	CPreviewPipeline(IEditorBuffer& buffer, IPreviewSink& sink);
+
+	// Runs the whole path for the current buffer contents. Drops any blocks
+	// still pending from the previous refresh.
+	//
+	// Work that wouldn't change what the preview shows is skipped: nothing
+	// after the fetch runs if the text is the same as last time, and HTML
+	// that's identical to what was last published (for the whole body, or
+	// for a block) isn't encoded or sent to the sink again.
+	void Refresh();
+	// Makes the next Refresh() publish everything, as if it were the first.
+	void Invalidate();
+
+	// Finishes processing the document, then renders and publishes pending
+	// blocks, for up to `sliceMs` milliseconds; blocks below the viewport go
+	// first, then those above it. Returns true while work remains.
+	bool FillPending(unsigned sliceMs);
+	bool HasPending() const { return processing_ || nextPending_ < pending_.size(); }
+	// True while the current document's processing is still unfinished.
+	bool Processing() const { return processing_; }
+
+	void SetBudget(const markdown::Budget& budget) { budget_ = budget; Invalidate(); }
+	const markdown::Budget& GetBudget() const { return budget_; }
+
+	// In progressive mode (the default), blocks outside the viewport are
+	// published straight away with their block structure and raw inline
+	// text, and FillPending() replaces each with its finished HTML;
+	// otherwise they stay empty until then.
+	void SetProgressive(bool progressive) { progressive_ = progressive; Invalidate(); }
+	bool IsProgressive() const { return progressive_; }
+
+	// Puts a line with the latest render timings above the preview.
+	void ShowStats(bool show);
+	bool ShowingStats() const { return showStats_; }
+	const CRenderStats& Stats() const { return stats_; }
+
+	// How often the fingerprints let Refresh() and FillPending() stop early.
+	struct FingerprintCounts
+	{
+		unsigned long sourceHits, sourceMisses; // Per refresh
+		unsigned long blockHits, blockMisses;   // Per published body or block
+
+		FingerprintCounts() : sourceHits(0), sourceMisses(0), blockHits(0), blockMisses(0) {}
+	};
+	const FingerprintCounts& Counts() const { return counts_; }
+
+	static std::wstring BlockId(size_t block);
+	static unsigned long long Fingerprint(const void* data, size_t size,
+		unsigned long long hash = 14695981039346656037ULL);
+	static const wchar_t* StatusId() { return L"mdstatus"; }
+
+	// Converts rendered HTML in the given Scintilla code page to UTF-16;
+	// false if the code page isn't supported.
+	static bool ToWide(const std::string& html, int codepage, std::wstring& wHtml);
+
+private:
+	void Publish();
+	const std::string& RenderBlock(size_t block);
+	const std::string& RenderSkeleton(size_t block);
+	void AppendStatusElement(std::wstring& body) const;
+	void AppendBudgetNotice(std::wstring& body) const;
+	void PublishStats();
+	void ResetStream();
+	bool PublishBlock(size_t block, long long& encodeMicros, long long& publishMicros);
+
+	IEditorBuffer& buffer_;
+	IPreviewSink& sink_;
+
+	// Kept from one refresh to the next; text_ and body_ hold on to their
+	// capacity, so typing doesn't reallocate document-sized buffers.
+	std::string text_;
+	std::ostringstream stream_;
+	std::string html_;
+	std::wstring wHtml_;
+	std::wstring body_;
+	boost::scoped_ptr<markdown::Document> doc_;
+	markdown::Budget budget_;
+	int codepage_;
+	bool processing_;
+
+	std::vector<size_t> pending_;
+	size_t nextPending_;
+	size_t anchorBlock_;
+
+	CRenderStats stats_;
+	bool showStats_;
+	bool progressive_;
+
+	// Fingerprints of what the preview currently shows: the source it came
+	// from, and either the whole body or, in viewport mode, each block (0 for
+	// placeholders that are still empty).
+	unsigned long long sourceHash_;
+	unsigned long long bodyHash_;
+	std::vector<unsigned long long> blockHashes_;
+	FingerprintCounts counts_;
+	markdown::OverBudget shownOverBudget_;
+};
@@ -0,0 +1,51 @@
+#include "RefreshPolicy.h"
+
+const double CRefreshPolicy::cSmoothing = 0.3;
+const double CRefreshPolicy::cDebounceFactor = 2.0;
+
+CRefreshPolicy::CRefreshPolicy(unsigned inputBudgetMs, unsigned idleThresholdMs, unsigned idleDelayMs)
+	: inputBudgetMs_(inputBudgetMs), idleThresholdMs_(idleThresholdMs), idleDelayMs_(idleDelayMs)
+{
+}
+
+CRefreshPolicy::Decision CRefreshPolicy::OnModified(BufferKey buffer) const
+{
+	Decision decision = { cRefreshNow, 0 };
+	double average = AverageMs(buffer);
+	if (average <= inputBudgetMs_)
+		return decision;
+
+	if (average > idleThresholdMs_)
+	{
+		decision.action = cIdleOnly;
+		decision.delayMs = idleDelayMs_;
+		return decision;
+	}
+
+	// A render that costs several keystrokes' worth of time should wait for
+	// a pause at least that long, or it runs again before the user notices
+	// the last one.
+	unsigned delay = (unsigned)(average * cDebounceFactor);
+	if (delay < cMinDebounceMs)
+		delay = cMinDebounceMs;
+	if (delay > idleDelayMs_)
+		delay = idleDelayMs_;
+	decision.action = cDebounce;
+	decision.delayMs = delay;
+	return decision;
+}
+
+void CRefreshPolicy::RecordRender(BufferKey buffer, double renderMs)
+{
+	std::map<BufferKey, double>::iterator i = averageMs_.find(buffer);
+	if (i == averageMs_.end())
+		averageMs_[buffer] = renderMs;
+	else
+		i->second += cSmoothing * (renderMs - i->second);
+}
+
+double CRefreshPolicy::AverageMs(BufferKey buffer) const
+{
+	std::map<BufferKey, double>::const_iterator i = averageMs_.find(buffer);
+	return i == averageMs_.end() ? -1.0 : i->second;
+}
@@ -0,0 +1,54 @@
+#pragma once
+// Decides how soon the live preview should follow an edit, from how long the
+// buffer's recent renders took. Cheap documents refresh on every change;
+// costlier ones wait until typing pauses for a while proportional to the
+// cost; huge ones only refresh once the editor has gone idle. Portable, and
+// fed with render times by the caller, so it can be driven with made-up ones.
+
+#include <map>
+
+class CRefreshPolicy
+{
+public:
+	enum Action { cRefreshNow, cDebounce, cIdleOnly };
+
+	struct Decision
+	{
+		Action action;
+		unsigned delayMs; // How long the edits must pause first; 0 for cRefreshNow
+	};
+
+	// Identifies a buffer; anything stable for its lifetime will do.
+	typedef const void* BufferKey;
+
+	// Renders expected to take no more than `inputBudgetMs` run right away,
+	// since they can't hold up typing noticeably. Past `idleThresholdMs` a
+	// buffer is only refreshed after `idleDelayMs` without edits.
+	CRefreshPolicy(unsigned inputBudgetMs = 30, unsigned idleThresholdMs = 1000,
+		unsigned idleDelayMs = 1500);
+
+	// What to do about an edit to the buffer. Buffers with no renders on
+	// record yet refresh right away, which gives them one.
+	Decision OnModified(BufferKey buffer) const;
+
+	void RecordRender(BufferKey buffer, double renderMs);
+	void Forget(BufferKey buffer) { averageMs_.erase(buffer); }
+
+	// The moving average for the buffer, or a negative number if there's none.
+	double AverageMs(BufferKey buffer) const;
+
+	unsigned InputBudgetMs() const { return inputBudgetMs_; }
+	void SetInputBudgetMs(unsigned budgetMs) { inputBudgetMs_ = budgetMs; }
+
+private:
+	// Weight of the newest render in the moving average.
+	static const double cSmoothing;
+	// Debounce delay per millisecond of expected render time, and its lower bound.
+	static const double cDebounceFactor;
+	enum { cMinDebounceMs = 50 };
+
+	unsigned inputBudgetMs_;
+	unsigned idleThresholdMs_;
+	unsigned idleDelayMs_;
+	std::map<BufferKey, double> averageMs_;
+};
@@ -0,0 +1,98 @@
+#include "RenderStats.h"
+
+#include <sstream>
+#include <iomanip>
+
+CRollingHistogram::CRollingHistogram()
+	: next_(0), count_(0)
+{
+	for (size_t i = 0; i < cBuckets; ++i)
+		buckets_[i] = 0;
+}
+
+void CRollingHistogram::Add(unsigned long long micros)
+{
+	if (count_ == cWindow)
+		--buckets_[Bucket(samples_[next_])];
+	else
+		++count_;
+	samples_[next_] = micros;
+	++buckets_[Bucket(micros)];
+	next_ = (next_ + 1) % cWindow;
+}
+
+unsigned long long CRollingHistogram::Last() const
+{
+	if (count_ == 0)
+		return 0;
+	return samples_[(next_ + cWindow - 1) % cWindow];
+}
+
+unsigned long long CRollingHistogram::Percentile(double fraction) const
+{
+	if (count_ == 0)
+		return 0;
+	size_t wanted = (size_t)(fraction * count_ + 0.5);
+	if (wanted < 1)
+		wanted = 1;
+	size_t seen = 0;
+	for (size_t i = 0; i < cBuckets; ++i)
+	{
+		seen += buckets_[i];
+		if (seen >= wanted)
+			return (1ULL << i) - 1;
+	}
+	return (1ULL << (cBuckets - 1)) - 1;
+}
+
+size_t CRollingHistogram::Bucket(unsigned long long micros)
+{
+	// Bucket i holds [2^(i-1), 2^i) microseconds; bucket 0 holds 0.
+	size_t i = 0;
+	while (micros != 0 && i < cBuckets - 1)
+	{
+		micros >>= 1;
+		++i;
+	}
+	return i;
+}
+
+void CRenderStats::Add(const markdown::Timings& timings)
+{
+	Add(cRead, timings.read);
+	Add(cMergeHtmlTags, timings.mergeHtmlTags);
+	Add(cInlineHtmlAndReferences, timings.inlineHtmlAndReferences);
+	Add(cBlocks, timings.blocks);
+	Add(cParagraphs, timings.paragraphs);
+	Add(cSpans, timings.spans);
+	Add(cWrite, timings.write);
+}
+
+const wchar_t* CRenderStats::StageName(Stage stage)
+{
+	static const wchar_t* const cNames[cStageCount] =
+	{
+		L"fetch", L"read", L"tags", L"inline", L"blocks",
+		L"paragraphs", L"spans", L"write", L"encode", L"publish", L"fill"
+	};
+	return cNames[stage];
+}
+
+std::wstring CRenderStats::Summary() const
+{
+	std::wostringstream line;
+	line << std::fixed << std::setprecision(1);
+	bool first = true;
+	for (int s = 0; s < cStageCount; ++s)
+	{
+		const CRollingHistogram& h = stages_[s];
+		if (h.Count() == 0)
+			continue;
+		if (!first)
+			line << L" | ";
+		first = false;
+		line << StageName((Stage)s) << L' ' << h.Last() / 1000.0
+			<< L" (p90 " << h.Percentile(0.9) / 1000.0 << L") ms";
+	}
+	return line.str();
+}
@@ -0,0 +1,54 @@
+#pragma once
+// Rolling timings for each stage of the preview path, so a slow preview can
+// be pinned on a stage without a profiler.
+
+#include <string>
+#include "markdown.h"
+
+// The last cWindow samples of one stage, in microseconds, counted into
+// power-of-two buckets.
+class CRollingHistogram
+{
+public:
+	enum { cWindow = 64, cBuckets = 40 };
+
+	CRollingHistogram();
+
+	void Add(unsigned long long micros);
+	size_t Count() const { return count_; }
+	unsigned long long Last() const;
+	// Upper bound of the bucket that holds the given fraction (0..1) of the
+	// samples in the window.
+	unsigned long long Percentile(double fraction) const;
+
+private:
+	static size_t Bucket(unsigned long long micros);
+
+	unsigned long long samples_[cWindow];
+	size_t buckets_[cBuckets];
+	size_t next_, count_;
+};
+
+class CRenderStats
+{
+public:
+	enum Stage
+	{
+		cFetch, cRead, cMergeHtmlTags, cInlineHtmlAndReferences, cBlocks,
+		cParagraphs, cSpans, cWrite, cEncode, cPublish, cFill, cStageCount
+	};
+
+	void Add(Stage stage, unsigned long long micros) { stages_[stage].Add(micros); }
+	// Adds the engine's own stages (read through write) from one document.
+	void Add(const markdown::Timings& timings);
+	const CRollingHistogram& Get(Stage stage) const { return stages_[stage]; }
+
+	static const wchar_t* StageName(Stage stage);
+
+	// One line for the preview's status bar: each stage's last time and its
+	// 90th percentile, in milliseconds.
+	std::wstring Summary() const;
+
+private:
+	CRollingHistogram stages_[cStageCount];
+};
@@ -694,111 +694,114 @@ public:
 		if (SUCCEEDED(hRet) && pDoc != NULL)
 		{
 			CComQIPtr<IHTMLDocument2> spDoc(pDoc);
-			BSTR str;
-			spDoc->get_fileSize(&str);
-			CString strSize(str);
-			ulSize = _wtoi(strSize);
+			CComBSTR bsSize;
+			if (spDoc && SUCCEEDED(spDoc->get_fileSize(&bsSize)) && bsSize)
+				ulSize = _wtoi(bsSize);
 		}
 		return ulSize;
 	}
-	void SetHTMLBody(CString html)
+	void SetHTMLBody(LPCWSTR html)
+	{
+		CComPtr<IHTMLDocument2> spDoc;
+		if (!GetHTMLDocument(&spDoc))
+			return;
+		CComPtr<IHTMLElement> spBody;
+		HRESULT hRet = spDoc->get_body(&spBody);
+		if (FAILED(hRet) || !spBody)
+			return;
+		CComBSTR bsHtml(html);
+		spBody->put_innerHTML(bsHtml);
+	}
+
+	// Replaces the contents of the element with the given id; used to fill in
+	// the preview one block at a time.
+	void SetElementHTML(LPCWSTR id, LPCWSTR html)
+	{
+		CComPtr<IHTMLElement> spElem;
+		if (!GetElementById(id, &spElem))
+			return;
+		CComBSTR bsHtml(html);
+		spElem->put_innerHTML(bsHtml);
+	}
+
+	void ScrollToElement(LPCWSTR id)
+	{
+		CComPtr<IHTMLElement> spElem;
+		if (!GetElementById(id, &spElem))
+			return;
+		CComVariant vTop(true);
+		spElem->scrollIntoView(vTop);
+	}
+
+	bool GetHTMLDocument(IHTMLDocument2** ppDoc)
 	{
 		CComPtr<IWebBrowser2> spWebBrowser2;
 		HRESULT hRet = QueryControl (IID_IWebBrowser2, (void**)&spWebBrowser2);
 		if (FAILED(hRet))
-		{
-			return;
-		}
+			return false;
 		CComPtr<IDispatch> pDoc;
 		hRet = spWebBrowser2->get_Document(&pDoc);
-		if (SUCCEEDED(hRet) && pDoc != NULL)
-		{
-			IHTMLDocument2 * iDocu;
-			hRet = pDoc->QueryInterface(IID_IHTMLDocument2, (void**)&iDocu);
-			IHTMLElement * iElem;
-			hRet = iDocu->get_body(&iElem);
-			if (FAILED(hRet))
-				return;
-			BSTR str = html.AllocSysString();
-			iElem->put_innerHTML(str);
-		}
+		if (FAILED(hRet) || pDoc == NULL)
+			return false;
+		hRet = pDoc->QueryInterface(IID_IHTMLDocument2, (void**)ppDoc);
+		return SUCCEEDED(hRet) && *ppDoc != NULL;
 	}
 
-	ATL::CString GetHTMLBody()
+	bool GetElementById(LPCWSTR id, IHTMLElement** ppElem)
 	{
-		ATL::CString sRet;
 		CComPtr<IWebBrowser2> spWebBrowser2;
 		HRESULT hRet = QueryControl (IID_IWebBrowser2, (void**)&spWebBrowser2);
 		if (FAILED(hRet))
-		{
-			return sRet;
-		}
+			return false;
 		CComPtr<IDispatch> pDoc;
 		hRet = spWebBrowser2->get_Document(&pDoc);
-		if (SUCCEEDED(hRet) && pDoc != NULL)
-		{
-			IHTMLDocument2 * iDocu;
-			hRet = pDoc->QueryInterface(IID_IHTMLDocument2, (void**)&iDocu);
-			IHTMLElement * iElem;
-			hRet = iDocu->get_body(&iElem);
-			if (FAILED(hRet))
-				return sRet;
-			BSTR str;
-			hRet = iElem->get_innerHTML(&str);
-			if (FAILED(hRet))
-				return sRet;
-			sRet = str;
-		}
+		if (FAILED(hRet) || pDoc == NULL)
+			return false;
+		CComQIPtr<IHTMLDocument3> spDoc(pDoc);
+		if (!spDoc)
+			return false;
+		CComBSTR bsId(id);
+		hRet = spDoc->getElementById(bsId, ppElem);
+		return SUCCEEDED(hRet) && *ppElem != NULL;
+	}
+
+	ATL::CString GetHTMLBody()
+	{
+		ATL::CString sRet;
+		CComPtr<IHTMLDocument2> spDoc;
+		if (!GetHTMLDocument(&spDoc))
+			return sRet;
+		CComPtr<IHTMLElement> spBody;
+		HRESULT hRet = spDoc->get_body(&spBody);
+		if (FAILED(hRet) || !spBody)
+			return sRet;
+		CComBSTR bsHtml;
+		hRet = spBody->get_innerHTML(&bsHtml);
+		if (FAILED(hRet))
+			return sRet;
+		sRet = bsHtml;
 		return sRet;
 	}
 
 	ATL::CString GetCharSet()
 	{
 		ATL::CString sRet;
-		CComPtr<IWebBrowser2> spWebBrowser2;
-		HRESULT hRet = QueryControl (IID_IWebBrowser2, (void**)&spWebBrowser2);
-		if (FAILED(hRet))
-		{
+		CComPtr<IHTMLDocument2> spDoc;
+		if (!GetHTMLDocument(&spDoc))
 			return sRet;
-		}
-		CComPtr<IDispatch> pDoc;
-		hRet = spWebBrowser2->get_Document(&pDoc);
-		if (SUCCEEDED(hRet) && pDoc != NULL)
-		{
-			IHTMLDocument2 * iDocu;
-			hRet = pDoc->QueryInterface(IID_IHTMLDocument2, (void**)&iDocu);
-			if (FAILED(hRet))
-			{
-				return sRet;
-			}
-			BSTR str;
-			iDocu->get_charset(&str);
-			sRet = str;
-		}
+		CComBSTR bsCharset;
+		if (SUCCEEDED(spDoc->get_charset(&bsCharset)))
+			sRet = bsCharset;
 		return sRet;
 	}
 
-	void SetCharSet(ATL::CString charset)
+	void SetCharSet(LPCWSTR charset)
 	{
-		CComPtr<IWebBrowser2> spWebBrowser2;
-		HRESULT hRet = QueryControl (IID_IWebBrowser2, (void**)&spWebBrowser2);
-		if (FAILED(hRet))
-		{
+		CComPtr<IHTMLDocument2> spDoc;
+		if (!GetHTMLDocument(&spDoc))
 			return;
-		}
-		CComPtr<IDispatch> pDoc;
-		hRet = spWebBrowser2->get_Document(&pDoc);
-		if (SUCCEEDED(hRet) && pDoc != NULL)
-		{
-			IHTMLDocument2 * iDocu;
-			hRet = pDoc->QueryInterface(IID_IHTMLDocument2, (void**)&iDocu);
-			if (FAILED(hRet))
-			{
-				return;
-			}
-			BSTR str = charset.AllocSysString();
-			iDocu->put_charset(str);
-		}
+		CComBSTR bsCharset(charset);
+		spDoc->put_charset(bsCharset);
 	}
 };
 
@@ -24,6 +24,8 @@ DemoDlg _goToLine;
 
 // 򿪳ǷʼԤԻ
 BOOL bReady = FALSE;
+// Whether the preview shows a line of render timings above the document
+BOOL bShowRenderStats = FALSE;
 //
 // Initialize your plugin data here
 // It will be called while plugin loading   
@@ -47,6 +49,7 @@ void ShowPreviewDlg()
 	if (!_goToLine.isCreated())
 	{
 		_goToLine.create(&data);
+		_goToLine.dlg->ShowRenderStats(bShowRenderStats != FALSE);
 
 		// define the default docking behaviour
 		data.uMask = DWS_DF_CONT_RIGHT;
@@ -63,6 +66,14 @@ void ShowPreviewDlg()
 	
 }
 
+void ToggleRenderStats()
+{
+	bShowRenderStats = !bShowRenderStats;
+	::SendMessage(nppData._nppHandle, NPPM_SETMENUITEMCHECK, funcItem[1]._cmdID, bShowRenderStats);
+	if (_goToLine.dlg)
+		_goToLine.dlg->ShowRenderStats(bShowRenderStats != FALSE);
+}
+
 //
 // Initialization of your plugin commands
 // You should fill your plugins commands here
@@ -80,6 +91,7 @@ void commandMenuInit()
 	//            bool check0nInit                // optional. Make this menu item be checked visually
 	//            );
 	setCommand(0, TEXT("Show Markdown Preview Dialog"), ShowPreviewDlg, NULL, false);
+	setCommand(1, TEXT("Show Render Timings"), ToggleRenderStats, NULL, false);
 }
 
 //
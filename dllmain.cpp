@@ -25,42 +25,6 @@ extern BOOL bReady;
 
 
 
-class CPerformanceWatch
-{
-public:
-	CPerformanceWatch()
-	{
-		QueryPerformanceFrequency(&m_liPerfFreq);
-		Start();
-	}
-
-	// ִ
-	__int64 Now() const
-	{
-		LARGE_INTEGER liPerfNow;
-		QueryPerformanceCounter(&liPerfNow);
-		return (((liPerfNow.QuadPart - m_liPerfStart.QuadPart) * 1000) / m_liPerfFreq.QuadPart);
-	}
-	// ִ΢
-	__int64 NowInMicro() const
-	{
-		LARGE_INTEGER liPerfNow;
-		QueryPerformanceCounter(&liPerfNow);
-		return (((liPerfNow.QuadPart - m_liPerfStart.QuadPart) * 1000000) / m_liPerfFreq.QuadPart);
-	}
-
-private:
-	LARGE_INTEGER m_liPerfFreq;
-	LARGE_INTEGER m_liPerfStart;
-
-	void Start()
-	{
-		QueryPerformanceCounter(&m_liPerfStart);
-	}
-};
-
-
-
 BOOL APIENTRY DllMain( HMODULE hModule,
                        DWORD  ul_reason_for_call,
                        LPVOID lpReserved
@@ -84,11 +48,31 @@ BOOL APIENTRY DllMain( HMODULE hModule,
 	return TRUE;
 }
 
+// Gets the Markdown engine ready off the UI thread, so neither Notepad++
+// startup nor the first preview pays for compiling its expressions.
+unsigned _stdcall WarmUpThreadProc(void* /*param*/)
+{
+	try
+	{
+		markdown::warmUp();
+	}
+	catch (...)
+	{
+		// The first preview will do it instead.
+	}
+	return 0;
+}
+
 extern "C" __declspec(dllexport) void setInfo(NppData notpadPlusData)
 {
 	nppData = notpadPlusData;
 
 	commandMenuInit();
+
+	// Not from pluginInit: that runs inside DllMain, under the loader lock.
+	HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, WarmUpThreadProc, NULL, 0, NULL);
+	if (hThread)
+		::CloseHandle(hThread);
 }
 
 extern "C" __declspec(dllexport) const TCHAR * getName()
@@ -122,16 +106,21 @@ void vSplitString( wstring& strSrc , vector<wstring>& vecDest , char cSeparator)
 }
 
 
-unsigned _stdcall ThreadProc(void* param)
-{
-
-	return 0;
-}
 
 
 extern "C" __declspec(dllexport) void beNotified(SCNotification *notifyCode)
 {
-	if (notifyCode->nmhdr.code == SCN_MODIFIED && bReady)
+	if (notifyCode->nmhdr.code == NPPN_FILECLOSED && notifyCode->nmhdr.hwndFrom == nppData._nppHandle)
+	{
+		if (_goToLine.dlg)
+			_goToLine.dlg->OnBufferClosed((CRefreshPolicy::BufferKey)notifyCode->nmhdr.idFrom);
+		return;
+	}
+
+	// Only text changes matter to the preview; the lexer's restyling after
+	// every keystroke arrives as SCN_MODIFIED too.
+	if (notifyCode->nmhdr.code == SCN_MODIFIED && bReady
+		&& (notifyCode->modificationType & (SC_MOD_INSERTTEXT | SC_MOD_DELETETEXT)))
 //	if (notifyCode->line)
 	{
 		if (_goToLine.dlg)
@@ -144,7 +133,7 @@ extern "C" __declspec(dllexport) void beNotified(SCNotification *notifyCode)
 			{
 				return;
 			}
-			_goToLine.dlg->Tans();
+			_goToLine.dlg->OnBufferModified();
 		}
 	}
 }
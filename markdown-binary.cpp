@@ -0,0 +1,110 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#include "markdown-binary.h"
+#include "markdown-tokens.h"
+
+#include <cstring>
+
+namespace markdown {
+namespace binary {
+
+void Writer::add(const Token& block) {
+	block.writeAsHtml(mHtml);
+	std::streamoff end=mHtml.tellp();
+	if (end<0 || boost::uintmax_t(end)>uint32(-1)) mTooBig=true;
+	mEnds.push_back(uint32(end));
+}
+
+bool Writer::write(std::ostream& out, size_t sourceLines) const {
+	if (mTooBig || sourceLines>uint32(-1) || mEnds.size()>uint32(-1)/sizeof(uint32))
+		return false;
+
+	const std::string html=mHtml.str();
+	Header header;
+	std::memcpy(header.magic, cMagic, sizeof(cMagic));
+	header.version=cVersion;
+	header.byteOrder=cByteOrderMark;
+	header.blockCount=uint32(mEnds.size());
+	header.htmlSize=uint32(html.length());
+	header.sourceLines=uint32(sourceLines);
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	if (!mEnds.empty()) out.write(reinterpret_cast<const char*>(&mEnds[0]),
+		mEnds.size()*sizeof(uint32));
+	out.write(html.data(), html.length());
+	return out.good();
+}
+
+} // namespace binary
+
+
+
+bool BinaryDocument::open(const std::string& path) {
+	close();
+	try {
+		mFile.open(path);
+	} catch (std::exception&) {
+		return false;
+	}
+	if (!mFile.is_open()) return false;
+	if (!load(mFile.data(), mFile.size())) { close(); return false; }
+	return true;
+}
+
+bool BinaryDocument::load(const char *data, size_t size) {
+	using namespace binary;
+
+	mHeader=0;
+	mEnds=0;
+	mHtml=0;
+
+	if (data==0 || size<sizeof(Header)) return false;
+	if (reinterpret_cast<size_t>(data)%sizeof(uint32)!=0) return false;
+	const Header *header=reinterpret_cast<const Header*>(data);
+	if (std::memcmp(header->magic, cMagic, sizeof(cMagic))!=0) return false;
+	if (header->byteOrder!=cByteOrderMark || header->version!=cVersion)
+		return false;
+	size_t rest=size-sizeof(Header);
+	if (header->blockCount>rest/sizeof(uint32)) return false;
+	if (rest-header->blockCount*sizeof(uint32)!=header->htmlSize) return false;
+
+	// Checked once here, so write() can trust every offset.
+	const uint32 *ends=reinterpret_cast<const uint32*>(data+sizeof(Header));
+	uint32 previous=0;
+	for (size_t b=0; b<header->blockCount; ++b) {
+		if (ends[b]<previous) return false;
+		previous=ends[b];
+	}
+	if (previous!=header->htmlSize) return false;
+
+	mHeader=header;
+	mEnds=ends;
+	mHtml=data+sizeof(Header)+header->blockCount*sizeof(uint32);
+	return true;
+}
+
+void BinaryDocument::close() {
+	mHeader=0;
+	mEnds=0;
+	mHtml=0;
+	if (mFile.is_open()) mFile.close();
+}
+
+void BinaryDocument::write(std::ostream& out) const {
+	if (mHeader!=0) out.write(mHtml, mHeader->htmlSize);
+}
+
+void BinaryDocument::write(std::ostream& out, size_t firstBlock, size_t
+	lastBlock) const
+{
+	if (lastBlock>blockCount()) lastBlock=blockCount();
+	if (firstBlock>=lastBlock) return;
+	size_t start=(firstBlock!=0 ? mEnds[firstBlock-1] : 0);
+	out.write(mHtml+start, mEnds[lastBlock-1]-start);
+}
+
+} // namespace markdown
@@ -0,0 +1,95 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_BINARY_H_INCLUDED
+#define MARKDOWN_BINARY_H_INCLUDED
+
+#include "markdown.h"
+
+#include <sstream>
+
+#include <boost/cstdint.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+namespace markdown {
+
+// The binary form of a processed document, as Document::writeBinary() writes
+// it: a header, then a table with a 32-bit offset for each top-level block,
+// where its HTML ends, then the HTML of all the blocks, one after another.
+// It's just the HTML the document would write, indexed by block, so it takes
+// only four bytes a block more than the HTML does. It isn't a syntax tree:
+// nothing about the tokens is kept but the HTML they made. Everything is in
+// the byte order of the machine that wrote it, and a file from a machine with
+// the other byte order, or from another version of the format, is refused
+// rather than converted.
+namespace binary {
+
+typedef boost::uint32_t uint32;
+
+static const char cMagic[4]={ 'M', 'D', 'A', 'T' };
+static const uint32 cVersion=2;
+static const uint32 cByteOrderMark=0x01020304;
+
+struct Header {
+	char magic[4];
+	uint32 version;
+	uint32 byteOrder;
+	uint32 blockCount;
+	uint32 htmlSize;
+	uint32 sourceLines;
+};
+
+// Builds the binary form a top-level block at a time; this is what
+// Document::writeBinary() uses.
+class Writer {
+	public:
+	Writer(): mTooBig(false) { }
+
+	void add(const Token& block);
+	// False if the document is too big for the format's 32-bit offsets.
+	bool write(std::ostream& out, size_t sourceLines) const;
+
+	private:
+	std::ostringstream mHtml;
+	std::vector<uint32> mEnds;
+	bool mTooBig;
+};
+
+} // namespace binary
+
+// A document in the binary form, read in place: open() maps the file into
+// memory, and write() gives the same HTML that Document::write() gave when
+// it was saved, straight from the mapped file. Nothing is parsed or copied,
+// and no tokens are built.
+class BinaryDocument: private boost::noncopyable {
+	public:
+	BinaryDocument(): mHeader(0), mEnds(0), mHtml(0) { }
+
+	// Both return false, and leave the document empty, if the data isn't a
+	// complete and consistent document in this version of the format. The
+	// memory given to load() has to stay valid, and unchanged, while the
+	// document is in use, and has to be aligned for a uint32.
+	bool open(const std::string& path);
+	bool load(const char *data, size_t size);
+	void close();
+
+	bool empty() const { return (mHeader==0); }
+	size_t blockCount() const { return (mHeader!=0 ? mHeader->blockCount : 0); }
+	size_t sourceLines() const { return (mHeader!=0 ? mHeader->sourceLines : 0); }
+
+	void write(std::ostream& out) const;
+	void write(std::ostream& out, size_t firstBlock, size_t lastBlock) const;
+
+	private:
+	boost::iostreams::mapped_file_source mFile;
+	const binary::Header *mHeader;
+	const binary::uint32 *mEnds; // Where each block's HTML ends
+	const char *mHtml;
+};
+
+} // namespace markdown
+
+#endif // MARKDOWN_BINARY_H_INCLUDED
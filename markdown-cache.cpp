@@ -0,0 +1,289 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#include "markdown-cache.h"
+#include "markdown-binary.h"
+
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+namespace fs=boost::filesystem;
+
+namespace markdown {
+
+namespace {
+
+const char *cHtmlExtension=".html", *cBinaryExtension=".mdat",
+	*cTempExtension=".tmp";
+
+// A temporary file this old was left by a store that never finished (the
+// process died before renaming it); a younger one may still be being
+// written by another process sharing the directory.
+const std::time_t cStaleTempSeconds=60*60;
+
+// MurmurHash64A, which goes through the source eight bytes at a time; with
+// the length in the key too, a collision isn't a practical worry.
+boost::uint64_t hashBytes(const char *data, size_t length, boost::uint64_t
+	seed)
+{
+	const boost::uint64_t m=0xc6a4a7935bd1e995ULL;
+	const int r=47;
+
+	boost::uint64_t h=seed^(length*m);
+	const char *end=data+(length & ~size_t(7));
+	for (; data!=end; data+=8) {
+		boost::uint64_t k;
+		std::memcpy(&k, data, sizeof(k));
+		k*=m;
+		k^=k>>r;
+		k*=m;
+		h^=k;
+		h*=m;
+	}
+
+	switch (length & 7) {
+		case 7: h^=boost::uint64_t((unsigned char)data[6])<<48;
+			// fall through
+		case 6: h^=boost::uint64_t((unsigned char)data[5])<<40;
+			// fall through
+		case 5: h^=boost::uint64_t((unsigned char)data[4])<<32;
+			// fall through
+		case 4: h^=boost::uint64_t((unsigned char)data[3])<<24;
+			// fall through
+		case 3: h^=boost::uint64_t((unsigned char)data[2])<<16;
+			// fall through
+		case 2: h^=boost::uint64_t((unsigned char)data[1])<<8;
+			// fall through
+		case 1: h^=boost::uint64_t((unsigned char)data[0]);
+			h*=m;
+	}
+
+	h^=h>>r;
+	h*=m;
+	h^=h>>r;
+	return h;
+}
+
+bool hasExtension(const std::string& name, const char *ext) {
+	size_t n=std::strlen(ext);
+	return (name.length()>n && name.compare(name.length()-n, n, ext)==0);
+}
+
+bool olderThan(const std::pair<std::time_t, std::string>& a, const
+	std::pair<std::time_t, std::string>& b)
+{
+	return (a.first<b.first);
+}
+
+} // namespace
+
+const boost::uintmax_t RenderCache::cDefaultMaxBytes=256*1024*1024;
+const boost::uint32_t RenderCache::cHtmlVersion=1;
+
+RenderCache::RenderCache(const std::string& directory, boost::uintmax_t
+	maxBytes): mDirectory(directory), mMaxBytes(maxBytes), mUsable(false)
+{
+	boost::system::error_code ec;
+	fs::create_directories(mDirectory, ec);
+	if (!fs::is_directory(mDirectory, ec)) return;
+	mUsable=true;
+
+	std::time_t now=std::time(0);
+	for (fs::directory_iterator i(mDirectory, ec), ie; !ec && i!=ie;
+		i.increment(ec))
+	{
+		std::string name=i->path().filename().string();
+		if (hasExtension(name, cTempExtension)) {
+			boost::system::error_code fec;
+			std::time_t written=fs::last_write_time(i->path(), fec);
+			if (!fec && now-written>=cStaleTempSeconds) fs::remove(i->path(), fec);
+			continue;
+		}
+		if (!hasExtension(name, cHtmlExtension) && !hasExtension(name,
+			cBinaryExtension)) continue;
+
+		boost::system::error_code fec;
+		boost::uintmax_t size=fs::file_size(i->path(), fec);
+		if (fec) continue;
+		std::time_t used=fs::last_write_time(i->path(), fec);
+		if (fec) used=0;
+		mEntries[name]=Entry(size, used);
+		mStats.bytes+=size;
+	}
+
+	boost::mutex::scoped_lock lock(mMutex);
+	if (mStats.bytes>mMaxBytes) _trim();
+}
+
+std::string RenderCache::key(const std::string& source, size_t spacesPerTab)
+{
+	boost::uint64_t seed=(boost::uint64_t(cHtmlVersion)<<32) ^
+		(boost::uint64_t(binary::cVersion)<<16) ^ spacesPerTab;
+	boost::uint64_t h=hashBytes(source.data(), source.length(), seed);
+
+	std::ostringstream out;
+	out << std::hex;
+	out.fill('0');
+	out.width(16);
+	out << h << '-' << source.length();
+	return out.str();
+}
+
+boost::uint64_t RenderCache::hash(const std::string& data) {
+	return hashBytes(data.data(), data.length(), 0);
+}
+
+bool RenderCache::writeHtml(const std::string& key, std::ostream& out) {
+	std::string name=key+cHtmlExtension;
+	std::ifstream in(_path(name).c_str(), std::ios::in | std::ios::binary);
+	if (!in) return _found(name, false);
+	if (in.peek()!=std::char_traits<char>::eof()) out << in.rdbuf();
+	return _found(name, true);
+}
+
+bool RenderCache::storeHtml(const std::string& key, const std::string& html) {
+	return _store(key+cHtmlExtension, html);
+}
+
+bool RenderCache::findBinary(const std::string& key, BinaryDocument& doc) {
+	std::string name=key+cBinaryExtension;
+	return _found(name, doc.open(_path(name)));
+}
+
+bool RenderCache::storeBinary(const std::string& key, Document& doc, const
+	Cancellation *cancel)
+{
+	std::ostringstream out;
+	if (!doc.writeBinary(out, cancel)) return false;
+	return _store(key+cBinaryExtension, out.str());
+}
+
+bool RenderCache::convert(const std::string& source, std::ostream& out,
+	size_t spacesPerTab, bool withBinary, const Cancellation *cancel)
+{
+	std::string k=key(source, spacesPerTab);
+	if (writeHtml(k, out)) return true;
+
+	Document doc(spacesPerTab);
+	std::ostringstream html;
+	if (!doc.read(source, cancel) || !doc.write(html, cancel)) return false;
+	out << html.str();
+	storeHtml(k, html.str());
+	if (withBinary) storeBinary(k, doc, cancel);
+	return true;
+}
+
+RenderCache::Stats RenderCache::stats() const {
+	boost::mutex::scoped_lock lock(mMutex);
+	return mStats;
+}
+
+void RenderCache::maxBytes(boost::uintmax_t n) {
+	boost::mutex::scoped_lock lock(mMutex);
+	mMaxBytes=n;
+	if (mStats.bytes>mMaxBytes) _trim();
+}
+
+std::string RenderCache::_path(const std::string& name) const {
+	return (fs::path(mDirectory)/name).string();
+}
+
+bool RenderCache::_found(const std::string& name, bool found) {
+	boost::mutex::scoped_lock lock(mMutex);
+	if (!found) {
+		++mStats.misses;
+		return false;
+	}
+
+	++mStats.hits;
+	std::time_t now=std::time(0);
+	boost::system::error_code ec;
+	fs::last_write_time(_path(name), now, ec);
+	Entries::iterator i=mEntries.find(name);
+	if (i!=mEntries.end()) {
+		i->second.used=now;
+	} else {
+		// Stored by another process since the directory was read.
+		boost::uintmax_t size=fs::file_size(_path(name), ec);
+		if (!ec) {
+			mEntries[name]=Entry(size, now);
+			mStats.bytes+=size;
+			if (mStats.bytes>mMaxBytes) _trim();
+		}
+	}
+	return true;
+}
+
+bool RenderCache::_store(const std::string& name, const std::string& data) {
+	if (!mUsable) {
+		boost::mutex::scoped_lock lock(mMutex);
+		++mStats.failures;
+		return false;
+	}
+
+	// Written under a name no one else will use, then renamed over the
+	// entry, so there's never a partial entry to be read.
+	boost::system::error_code ec;
+	fs::path temp=fs::path(mDirectory)/fs::unique_path("%%%%-%%%%-%%%%-%%%%.tmp",
+		ec);
+	bool ok=!ec;
+	if (ok) {
+		std::ofstream out(temp.string().c_str(), std::ios::out |
+			std::ios::binary | std::ios::trunc);
+		out.write(data.data(), data.length());
+		out.close();
+		ok=!out.fail();
+	}
+	if (ok) {
+		fs::rename(temp, _path(name), ec);
+		ok=!ec;
+	}
+
+	boost::mutex::scoped_lock lock(mMutex);
+	if (!ok) {
+		fs::remove(temp, ec);
+		++mStats.failures;
+		return false;
+	}
+
+	Entry& e=mEntries[name];
+	mStats.bytes-=e.size;
+	e=Entry(data.length(), std::time(0));
+	mStats.bytes+=e.size;
+	++mStats.stores;
+	if (mStats.bytes>mMaxBytes) _trim();
+	return true;
+}
+
+void RenderCache::_trim() {
+	// Down to nine tenths of the limit, so a full cache doesn't have to do
+	// this on every store.
+	boost::uintmax_t target=mMaxBytes-mMaxBytes/10;
+
+	std::vector<std::pair<std::time_t, std::string> > byAge;
+	byAge.reserve(mEntries.size());
+	for (Entries::const_iterator i=mEntries.begin(), ie=mEntries.end(); i!=ie;
+		++i) byAge.push_back(std::make_pair(i->second.used, i->first));
+	std::stable_sort(byAge.begin(), byAge.end(), olderThan);
+
+	for (size_t n=0; n<byAge.size() && mStats.bytes>target; ++n) {
+		boost::system::error_code ec;
+		fs::path p=_path(byAge[n].second);
+		// A file that can't be removed (one that's mapped, on Windows) stays
+		// counted.
+		if (!fs::remove(p, ec) && (ec || fs::exists(p, ec))) continue;
+		Entries::iterator i=mEntries.find(byAge[n].second);
+		mStats.bytes-=i->second.size;
+		mEntries.erase(i);
+		++mStats.evictions;
+	}
+}
+
+} // namespace markdown
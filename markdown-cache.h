@@ -0,0 +1,111 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_CACHE_H_INCLUDED
+#define MARKDOWN_CACHE_H_INCLUDED
+
+#include "markdown.h"
+
+#include <string>
+#include <ctime>
+
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace markdown {
+
+class BinaryDocument;
+
+// An on-disk cache of converted documents, for converting the same files
+// again and again. Entries are named by a key made from a hash of the
+// source, the options that affect the output, and the version of the HTML
+// the engine writes, so an entry is never stale: a changed file just gets a
+// new one. Each is written to a temporary file and renamed into place, so a
+// reader (in this process or another) sees all of it or none of it. Any
+// temporary files a crash left behind are removed when the cache is made.
+//
+// The entries in the directory are kept under `maxBytes` in all, evicting
+// the ones least recently used (by file time, which a hit updates). The
+// sizes are tallied from the directory when the cache is made and kept up
+// to date from then on, so files that other processes add in the meantime
+// aren't counted until the next time.
+//
+// It can be used from several threads at once. Nothing throws: a directory
+// that can't be used makes every lookup a miss and every store a failure.
+class RenderCache: private boost::noncopyable {
+	public:
+	struct Stats {
+		size_t hits, misses, stores, evictions, failures;
+		boost::uintmax_t bytes; // In the directory, as far as it knows
+
+		Stats(): hits(0), misses(0), stores(0), evictions(0), failures(0),
+			bytes(0) { }
+	};
+
+	static const boost::uintmax_t cDefaultMaxBytes;
+	// Bump when a change to the engine changes the HTML it writes.
+	static const boost::uint32_t cHtmlVersion;
+
+	explicit RenderCache(const std::string& directory, boost::uintmax_t
+		maxBytes=cDefaultMaxBytes);
+
+	bool usable() const { return mUsable; }
+	const std::string& directory() const { return mDirectory; }
+
+	static std::string key(const std::string& source, size_t
+		spacesPerTab=Document::cDefaultSpacesPerTab);
+	// The hash the keys are made with, for telling apart other data.
+	static boost::uint64_t hash(const std::string& data);
+
+	// The rendered HTML. writeHtml() copies it to `out` on a hit.
+	bool writeHtml(const std::string& key, std::ostream& out);
+	bool storeHtml(const std::string& key, const std::string& html);
+
+	// The binary form (see markdown-binary.h). findBinary() opens it into
+	// `doc` on a hit; storeBinary() gets it from doc.writeBinary().
+	bool findBinary(const std::string& key, BinaryDocument& doc);
+	bool storeBinary(const std::string& key, Document& doc, const
+		Cancellation *cancel=0);
+
+	// Writes the HTML of `source` to `out`, from the cache if it's there,
+	// otherwise converting it and storing the result (and the binary form
+	// too, if `withBinary`). Returns false only if cancelled.
+	bool convert(const std::string& source, std::ostream& out, size_t
+		spacesPerTab=Document::cDefaultSpacesPerTab, bool withBinary=false, const
+		Cancellation *cancel=0);
+
+	Stats stats() const;
+	void maxBytes(boost::uintmax_t n);
+	boost::uintmax_t maxBytes() const { return mMaxBytes; }
+
+	private:
+	struct Entry {
+		boost::uintmax_t size;
+		std::time_t used;
+
+		Entry(boost::uintmax_t s=0, std::time_t u=0): size(s), used(u) { }
+	};
+	typedef boost::unordered_map<std::string, Entry> Entries;
+
+	std::string _path(const std::string& name) const;
+	bool _found(const std::string& name, bool found);
+	bool _store(const std::string& name, const std::string& data);
+	void _trim(); // With mMutex locked
+
+	const std::string mDirectory;
+	boost::uintmax_t mMaxBytes;
+	bool mUsable;
+
+	mutable boost::mutex mMutex;
+	Entries mEntries;
+	Stats mStats;
+};
+
+} // namespace markdown
+
+#endif // MARKDOWN_CACHE_H_INCLUDED
@@ -0,0 +1,578 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// markdown-convert: converts a tree of Markdown files to HTML, a file per
+// job on a WorkPool, and with --watch (on Linux) keeps converting the ones
+// that change. Run it without arguments for the options.
+
+#include "markdown.h"
+#include "markdown-pool.h"
+#include "markdown-cache.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#ifdef __linux__
+	#include <sys/inotify.h>
+	#include <poll.h>
+	#include <unistd.h>
+	#include <cerrno>
+#endif
+
+namespace fs=boost::filesystem;
+using markdown::Document;
+
+namespace {
+
+typedef boost::chrono::steady_clock Clock;
+
+// Roughly what a Document takes while it's being converted, per byte of
+// source: the lines, the tokens and the HTML together come to about 35 to
+// 65 times the size of the file.
+const boost::uintmax_t cMemoryPerSourceByte=64;
+
+// How long watch mode waits for the events of a save to stop coming before
+// rebuilding. Editors often write a file in several steps, or write a
+// temporary one and rename it.
+const int cSettleMs=20;
+
+struct Options {
+	size_t threads, spacesPerTab;
+	boost::uintmax_t maxMemory;
+	std::string cacheDirectory;
+	bool withBinary, quiet, watch;
+
+	Options(): threads(0), spacesPerTab(Document::cDefaultSpacesPerTab),
+		maxMemory(1024*1024*1024), withBinary(false), quiet(false),
+		watch(false) { }
+};
+
+struct File {
+	fs::path source, target;
+	boost::uintmax_t size;
+
+	File(const fs::path& s, const fs::path& t, boost::uintmax_t n): source(s),
+		target(t), size(n) { }
+};
+
+bool largerFirst(const File& a, const File& b) { return (a.size>b.size); }
+
+bool isMarkdown(const fs::path& p) {
+	std::string ext=p.extension().string();
+	return (ext==".md" || ext==".markdown" || ext==".mdown");
+}
+
+// The same path under the output directory, as .html.
+fs::path targetFor(const fs::path& source, const fs::path& output, const
+	fs::path& file)
+{
+	fs::path relative;
+	fs::path::const_iterator s=source.begin(), se=source.end();
+	fs::path::const_iterator p=file.begin(), pe=file.end();
+	while (s!=se && p!=pe && *s==*p) { ++s; ++p; }
+	for (; p!=pe; ++p) relative/=*p;
+	return (output/relative).replace_extension(".html");
+}
+
+// Lets jobs start only while the memory they're expected to need fits under
+// the limit. One that needs more than all of it waits until nothing else is
+// running, then runs alone.
+class MemoryGate: private boost::noncopyable {
+	public:
+	explicit MemoryGate(boost::uintmax_t limit): mLimit(limit), mInUse(0),
+		mRunning(0) { }
+
+	void acquire(boost::uintmax_t bytes) {
+		boost::mutex::scoped_lock lock(mLock);
+		while (mRunning!=0 && mInUse+bytes>mLimit) mFreed.wait(lock);
+		mInUse+=bytes;
+		++mRunning;
+	}
+
+	void release(boost::uintmax_t bytes) {
+		boost::mutex::scoped_lock lock(mLock);
+		mInUse-=bytes;
+		--mRunning;
+		mFreed.notify_all();
+	}
+
+	private:
+	const boost::uintmax_t mLimit;
+	boost::uintmax_t mInUse;
+	size_t mRunning;
+	boost::mutex mLock;
+	boost::condition_variable mFreed;
+};
+
+class Converter: private boost::noncopyable {
+	public:
+	Converter(const Options& options, const std::vector<File>& files):
+		mOptions(options), mFiles(files), mGate(options.maxMemory), mNext(0),
+		mFailures(0), mBytes(0)
+	{
+		if (!mOptions.cacheDirectory.empty())
+			mCache.reset(new markdown::RenderCache(mOptions.cacheDirectory));
+	}
+
+	enum Outcome {
+		cWritten,
+		cSameHtml, // Converted, but the HTML was what it wrote last time
+		cUnchanged, // The source was what it converted last time
+		cFailed
+	};
+
+	// Returns the number of files that couldn't be converted.
+	size_t run() {
+		markdown::WorkPool pool(mOptions.threads);
+		Clock::time_point start=Clock::now();
+
+		// The files are sorted largest first, and each worker takes the next
+		// one whenever it's free, so the big ones start early and the small
+		// ones fill in around them instead of one big file coming last.
+		pool.run(pool.threads(), boost::bind(&Converter::_worker, this, _1));
+
+		double ms=_ms(Clock::now()-start);
+		std::ostringstream out;
+		out << mFiles.size() << " files, " << mBytes << " bytes, " <<
+			std::fixed << std::setprecision(1) << ms << " ms on " <<
+			pool.threads() << " threads";
+		if (mFailures!=0) out << ", " << mFailures << " failed";
+		if (mCache) {
+			markdown::RenderCache::Stats s=mCache->stats();
+			out << "; cache " << s.hits << " hits, " << s.misses << " misses, "
+				<< s.evictions << " evicted";
+		}
+		_report(out.str(), std::cout);
+		return mFailures;
+	}
+
+	// Converts a file again after it has changed, if its source really has,
+	// and writes its output if the HTML has. For watch mode.
+	void update(const File& f) {
+		Clock::time_point start=Clock::now();
+		std::string error;
+		Outcome outcome=_convert(f, error);
+		_reportFile(f, outcome, error, _ms(Clock::now()-start));
+	}
+
+	// Forgets a file that has gone, and removes its output.
+	void remove(const File& f) {
+		{
+			boost::mutex::scoped_lock lock(mStatesLock);
+			mStates.erase(f.source.string());
+		}
+		boost::system::error_code ec;
+		fs::remove(f.target, ec);
+		if (!mOptions.quiet) _report("  removed " + f.target.string(), std::cout);
+	}
+
+	// The files it has converted and still remembers.
+	std::vector<fs::path> sources() const {
+		boost::mutex::scoped_lock lock(mStatesLock);
+		std::vector<fs::path> r;
+		r.reserve(mStates.size());
+		for (States::const_iterator i=mStates.begin(), ie=mStates.end(); i!=ie;
+			++i) r.push_back(i->first);
+		return r;
+	}
+
+	private:
+	// What watch mode remembers of a file: enough to tell whether its source
+	// or its HTML changed, without keeping either.
+	struct State {
+		std::string sourceKey;
+		boost::uint64_t html;
+		size_t htmlLength;
+	};
+	typedef std::map<std::string, State> States;
+
+	void _worker(size_t) {
+		for (;;) {
+			size_t n=mNext++;
+			if (n>=mFiles.size()) break;
+			const File& f=mFiles[n];
+
+			boost::uintmax_t need=f.size*cMemoryPerSourceByte;
+			mGate.acquire(need);
+			Clock::time_point start=Clock::now();
+			std::string error;
+			Outcome outcome=_convert(f, error);
+			double ms=_ms(Clock::now()-start);
+			mGate.release(need);
+
+			if (outcome==cFailed) ++mFailures;
+			else mBytes+=f.size;
+			_reportFile(f, outcome, error, ms);
+		}
+	}
+
+	Outcome _convert(const File& f, std::string& error) {
+		std::string source;
+		{
+			std::ifstream in(f.source.string().c_str(), std::ios::in |
+				std::ios::binary);
+			if (!in) { error="can't read it"; return cFailed; }
+			std::ostringstream all;
+			if (in.peek()!=std::char_traits<char>::eof()) all << in.rdbuf();
+			source=all.str();
+		}
+
+		State state;
+		bool known=false;
+		if (mOptions.watch) {
+			state.sourceKey=markdown::RenderCache::key(source,
+				mOptions.spacesPerTab);
+			boost::mutex::scoped_lock lock(mStatesLock);
+			States::const_iterator previous=mStates.find(f.source.string());
+			known=(previous!=mStates.end());
+			if (known && previous->second.sourceKey==state.sourceKey)
+				return cUnchanged;
+		}
+
+		std::ostringstream out;
+		if (mCache) {
+			mCache->convert(source, out, mOptions.spacesPerTab,
+				mOptions.withBinary);
+		} else {
+			Document doc(mOptions.spacesPerTab);
+			doc.read(source);
+			doc.write(out);
+		}
+		const std::string& html=out.str();
+
+		if (mOptions.watch) {
+			state.html=markdown::RenderCache::hash(html);
+			state.htmlLength=html.length();
+			boost::mutex::scoped_lock lock(mStatesLock);
+			State& s=mStates[f.source.string()];
+			bool same=(known && s.html==state.html && s.htmlLength==
+				state.htmlLength);
+			s=state;
+			boost::system::error_code ec;
+			if (same && fs::exists(f.target, ec)) return cSameHtml;
+		}
+
+		boost::system::error_code ec;
+		fs::create_directories(f.target.parent_path(), ec);
+		std::ofstream file(f.target.string().c_str(), std::ios::out |
+			std::ios::binary | std::ios::trunc);
+		if (!file) { error="can't write "+f.target.string(); return cFailed; }
+		file.write(html.data(), html.length());
+		file.close();
+		if (file.fail()) { error="error writing "+f.target.string(); return cFailed; }
+		return cWritten;
+	}
+
+	void _reportFile(const File& f, Outcome outcome, const std::string& error,
+		double ms)
+	{
+		std::ostringstream line;
+		if (outcome==cFailed) {
+			line << f.source.string() << ": " << error;
+			_report(line.str(), std::cerr);
+		} else if (!mOptions.quiet) {
+			line << std::fixed << std::setprecision(1) << std::setw(9) << ms
+				<< " ms " << std::setw(10) << f.size << "  " << f.source.string();
+			if (outcome==cSameHtml) line << " (same HTML, not written)";
+			else if (outcome==cUnchanged) line << " (unchanged)";
+			_report(line.str(), std::cout);
+		}
+	}
+
+	void _report(const std::string& line, std::ostream& out) {
+		boost::mutex::scoped_lock lock(mReportLock);
+		out << line << std::endl;
+	}
+
+	static double _ms(Clock::duration d) {
+		return boost::chrono::duration_cast<boost::chrono::microseconds>(d)
+			.count()/1000.0;
+	}
+
+	const Options& mOptions;
+	const std::vector<File>& mFiles;
+	boost::scoped_ptr<markdown::RenderCache> mCache;
+	MemoryGate mGate;
+	boost::atomic<size_t> mNext, mFailures;
+	boost::atomic<boost::uintmax_t> mBytes;
+	boost::mutex mReportLock;
+	mutable boost::mutex mStatesLock;
+	States mStates;
+};
+
+#ifdef __linux__
+// Watches the source tree with inotify and hands the Markdown files that
+// are written, moved in or removed to the converter, a settled batch at a
+// time. It watches directories rather than files, so it sees files that
+// editors save by renaming a new one over the old, and new directories are
+// watched as they turn up.
+class Watcher: private boost::noncopyable {
+	public:
+	Watcher(Converter& converter, const fs::path& source, const fs::path&
+		output): mConverter(converter), mSource(source), mOutput(output),
+		mFd(-1), mRescan(false) { }
+	~Watcher() { if (mFd>=0) ::close(mFd); }
+
+	bool start() {
+		mFd=inotify_init1(IN_CLOEXEC);
+		if (mFd<0) return false;
+		std::set<fs::path> ignored;
+		return _watch(mSource, ignored);
+	}
+
+	// Returns only if reading the events fails.
+	void run() {
+		std::vector<char> buffer(64*1024);
+		for (;;) {
+			std::set<fs::path> changed;
+			if (!_read(buffer, changed)) return;
+
+			// Let the rest of the save come in.
+			pollfd p={ mFd, POLLIN, 0 };
+			while (poll(&p, 1, cSettleMs)>0)
+				if (!_read(buffer, changed)) return;
+			if (mRescan) _rescan(changed);
+
+			for (std::set<fs::path>::const_iterator i=changed.begin(),
+				ie=changed.end(); i!=ie; ++i)
+			{
+				boost::system::error_code ec;
+				File f(*i, targetFor(mSource, mOutput, *i), 0);
+				if (fs::is_regular_file(*i, ec)) {
+					f.size=fs::file_size(*i, ec);
+					mConverter.update(f);
+				} else mConverter.remove(f);
+			}
+		}
+	}
+
+	private:
+	static const uint32_t cDirectoryEvents=IN_CLOSE_WRITE | IN_MOVED_TO |
+		IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_DELETE_SELF;
+
+	// Watches `dir` and the directories under it, adding the Markdown files
+	// in them to `found`.
+	bool _watch(const fs::path& dir, std::set<fs::path>& found) {
+		int wd=inotify_add_watch(mFd, dir.string().c_str(), cDirectoryEvents);
+		if (wd<0) return false;
+		mDirectories[wd]=dir;
+
+		boost::system::error_code ec;
+		for (fs::directory_iterator i(dir, ec), ie; !ec && i!=ie;
+			i.increment(ec))
+		{
+			if (fs::is_directory(i->path(), ec)) _watch(i->path(), found);
+			else if (isMarkdown(i->path())) found.insert(i->path());
+		}
+		return true;
+	}
+
+	// When events have been lost (the kernel's queue overflowed) or a
+	// directory has gone or moved away (its watch would go on reporting it
+	// under its old path), the watches are set up again from scratch, and
+	// every file there is now or was before is looked at again. The ones
+	// whose source is as it was are skipped, so this is mostly hashing.
+	void _rescan(std::set<fs::path>& changed) {
+		mRescan=false;
+		for (std::map<int, fs::path>::const_iterator i=mDirectories.begin(),
+			ie=mDirectories.end(); i!=ie; ++i) inotify_rm_watch(mFd, i->first);
+		mDirectories.clear();
+		_watch(mSource, changed);
+
+		std::vector<fs::path> known=mConverter.sources();
+		changed.insert(known.begin(), known.end());
+	}
+
+	bool _read(std::vector<char>& buffer, std::set<fs::path>& changed) {
+		ssize_t n=read(mFd, &buffer[0], buffer.size());
+		if (n<0) return (errno==EINTR);
+
+		for (const char *i=&buffer[0], *ie=i+n; i<ie; ) {
+			const inotify_event *e=reinterpret_cast<const inotify_event*>(i);
+			i+=sizeof(inotify_event)+e->len;
+
+			if (e->mask & IN_Q_OVERFLOW) { mRescan=true; continue; }
+
+			std::map<int, fs::path>::iterator dir=mDirectories.find(e->wd);
+			if (dir==mDirectories.end()) continue;
+			// The watch is gone: its directory was removed, or unmounted.
+			if (e->mask & IN_IGNORED) { mDirectories.erase(dir); continue; }
+			if (e->len==0) continue;
+
+			fs::path path=dir->second/e->name;
+			if (e->mask & IN_ISDIR) {
+				// A directory moved in can already have files in it.
+				if (e->mask & (IN_CREATE | IN_MOVED_TO)) _watch(path, changed);
+				if (e->mask & (IN_DELETE | IN_MOVED_FROM)) mRescan=true;
+			} else if (isMarkdown(path)) {
+				// Creating a file is followed by writing it, which is the
+				// event to go on.
+				if (!(e->mask & IN_CREATE)) changed.insert(path);
+			}
+		}
+		return true;
+	}
+
+	Converter& mConverter;
+	const fs::path mSource, mOutput;
+	int mFd;
+	std::map<int, fs::path> mDirectories;
+	bool mRescan;
+};
+#endif
+
+bool findFiles(const fs::path& source, const fs::path& output,
+	std::vector<File>& files)
+{
+	boost::system::error_code ec;
+	if (fs::is_regular_file(source, ec)) {
+		fs::path target=output;
+		if (fs::is_directory(output, ec))
+			target=output/source.filename().replace_extension(".html");
+		files.push_back(File(source, target, fs::file_size(source, ec)));
+		return true;
+	}
+	if (!fs::is_directory(source, ec)) return false;
+
+	for (fs::recursive_directory_iterator i(source, ec), ie; !ec && i!=ie;
+		i.increment(ec))
+	{
+		if (!fs::is_regular_file(i->path(), ec) || !isMarkdown(i->path()))
+			continue;
+
+		boost::system::error_code sec;
+		boost::uintmax_t size=fs::file_size(i->path(), sec);
+		if (sec) size=0;
+		files.push_back(File(i->path(), targetFor(source, output, i->path()),
+			size));
+	}
+	return !ec;
+}
+
+void usage() {
+	std::cerr <<
+		"usage: markdown-convert [options] SOURCE OUTPUT\n"
+		"\n"
+		"Converts SOURCE, a Markdown file or a directory tree of .md, .markdown\n"
+		"and .mdown files, to HTML under the directory OUTPUT (or to the file\n"
+		"OUTPUT, for a single file), printing the time each one took.\n"
+		"\n"
+		"  -j, --threads N   files converted at once (default: one per core)\n"
+		"  -m, --memory MB   memory the conversions in progress may use\n"
+		"                    (default: 1024)\n"
+		"  -t, --tab N       spaces per tab (default: 4)\n"
+		"  -c, --cache DIR   reuse the HTML of unchanged files from DIR\n"
+		"      --binary      also keep the binary form in the cache\n"
+		"  -q, --quiet       only print the summary and errors\n"
+		"  -w, --watch       after converting them, convert the files again\n"
+		"                    whenever they change, writing the ones whose\n"
+		"                    HTML changed (Linux only; SOURCE must be a\n"
+		"                    directory)\n";
+}
+
+bool number(const char *text, boost::uintmax_t& n) {
+	char *end=0;
+	unsigned long long v=std::strtoull(text, &end, 10);
+	if (end==text || *end!=0) return false;
+	n=v;
+	return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	Options options;
+	std::vector<std::string> paths;
+	for (int a=1; a<argc; ++a) {
+		std::string arg=argv[a];
+		bool hasValue=(a+1<argc);
+		boost::uintmax_t n=0;
+		if ((arg=="-j" || arg=="--threads") && hasValue && number(argv[++a], n)) {
+			options.threads=size_t(n);
+		} else if ((arg=="-m" || arg=="--memory") && hasValue && number(argv[++a],
+			n) && n!=0)
+		{
+			options.maxMemory=n*1024*1024;
+		} else if ((arg=="-t" || arg=="--tab") && hasValue && number(argv[++a],
+			n) && n!=0)
+		{
+			options.spacesPerTab=size_t(n);
+		} else if ((arg=="-c" || arg=="--cache") && hasValue) {
+			options.cacheDirectory=argv[++a];
+		} else if (arg=="--binary") {
+			options.withBinary=true;
+		} else if (arg=="-q" || arg=="--quiet") {
+			options.quiet=true;
+		} else if (arg=="-w" || arg=="--watch") {
+			options.watch=true;
+		} else if (!arg.empty() && arg[0]!='-') {
+			paths.push_back(arg);
+		} else {
+			usage();
+			return 2;
+		}
+	}
+	if (paths.size()!=2) {
+		usage();
+		return 2;
+	}
+
+	boost::system::error_code ec;
+	if (options.watch && !fs::is_directory(paths[0], ec)) {
+		std::cerr << "markdown-convert: --watch needs a source directory\n";
+		return 2;
+	}
+	#ifndef __linux__
+		if (options.watch) {
+			std::cerr << "markdown-convert: --watch needs inotify (Linux)\n";
+			return 2;
+		}
+	#endif
+
+	std::vector<File> files;
+	if (!findFiles(paths[0], paths[1], files)) {
+		std::cerr << "markdown-convert: can't read " << paths[0] << '\n';
+		return 1;
+	}
+	std::stable_sort(files.begin(), files.end(), largerFirst);
+
+	// Compiles the shared regular expressions and tables once, up front,
+	// rather than in whichever documents get to them first.
+	markdown::warmUp();
+
+	Converter converter(options, files);
+	#ifdef __linux__
+		if (options.watch) {
+			// Watching starts before the first conversion, so nothing saved
+			// while it's going on is missed; at worst it's converted twice.
+			Watcher watcher(converter, paths[0], paths[1]);
+			if (!watcher.start()) {
+				std::cerr << "markdown-convert: can't watch " << paths[0] << '\n';
+				return 1;
+			}
+			converter.run();
+			watcher.run();
+			std::cerr << "markdown-convert: lost the inotify events\n";
+			return 1;
+		}
+	#endif
+	return (converter.run()==0 ? 0 : 1);
+}
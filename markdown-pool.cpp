@@ -0,0 +1,100 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#include "markdown-pool.h"
+
+#include <boost/bind.hpp>
+
+namespace markdown {
+
+WorkPool::WorkPool(size_t threads): mThreadCount(threads!=0 ? threads :
+	(boost::thread::hardware_concurrency()!=0 ?
+	boost::thread::hardware_concurrency() : 1)), mShares(new
+	Share[mThreadCount]), mBatch(0), mBusy(0), mStopping(false), mJob(0)
+{
+	for (size_t t=1; t<mThreadCount; ++t)
+		mThreads.create_thread(boost::bind(&WorkPool::_worker, this, t));
+}
+
+WorkPool::~WorkPool() {
+	{
+		boost::lock_guard<boost::mutex> lock(mLock);
+		mStopping=true;
+	}
+	mWake.notify_all();
+	mThreads.join_all();
+}
+
+void WorkPool::run(size_t count, const Job& job) {
+	if (count==0) return;
+	if (mThreadCount==1) {
+		for (size_t i=0; i<count; ++i) job(i);
+		return;
+	}
+
+	boost::lock_guard<boost::mutex> running(mRunLock);
+	for (size_t t=0; t<mThreadCount; ++t) {
+		boost::lock_guard<boost::mutex> lock(mShares[t].lock);
+		mShares[t].next=count*t/mThreadCount;
+		mShares[t].end=count*(t+1)/mThreadCount;
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(mLock);
+		mJob=&job;
+		mBusy=mThreadCount-1;
+		++mBatch;
+	}
+	mWake.notify_all();
+
+	_work(0);
+
+	boost::unique_lock<boost::mutex> lock(mLock);
+	while (mBusy!=0) mDone.wait(lock);
+	mJob=0;
+}
+
+void WorkPool::_worker(size_t self) {
+	unsigned long done=0;
+	for (;;) {
+		{
+			boost::unique_lock<boost::mutex> lock(mLock);
+			while (!mStopping && mBatch==done) mWake.wait(lock);
+			if (mStopping) return;
+			done=mBatch;
+		}
+
+		_work(self);
+
+		boost::lock_guard<boost::mutex> lock(mLock);
+		if (--mBusy==0) mDone.notify_all();
+	}
+}
+
+void WorkPool::_work(size_t self) {
+	size_t job;
+	while (_take(self, job) || _steal(self, job)) (*mJob)(job);
+}
+
+bool WorkPool::_take(size_t self, size_t& job) {
+	Share& share=mShares[self];
+	boost::lock_guard<boost::mutex> lock(share.lock);
+	if (share.next==share.end) return false;
+	job=share.next++;
+	return true;
+}
+
+bool WorkPool::_steal(size_t self, size_t& job) {
+	for (size_t t=1; t<mThreadCount; ++t) {
+		Share& share=mShares[(self+t)%mThreadCount];
+		boost::lock_guard<boost::mutex> lock(share.lock);
+		if (share.next==share.end) continue;
+		job=--share.end;
+		return true;
+	}
+	return false;
+}
+
+} // namespace markdown
@@ -0,0 +1,71 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_POOL_H_INCLUDED
+#define MARKDOWN_POOL_H_INCLUDED
+
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace markdown {
+
+// A fixed set of worker threads for running batches of independent jobs,
+// numbered from zero. Each worker starts on its own contiguous share of the
+// numbers and, once that runs out, steals from the far end of the others'
+// shares, so a batch of uneven jobs (one long list among many short
+// paragraphs, say) still keeps them all busy.
+//
+// A pool can be shared by any number of documents, but it runs one batch
+// at a time; run() calls from other threads wait their turn.
+class WorkPool: private boost::noncopyable {
+	public:
+	typedef boost::function<void (size_t)> Job;
+
+	// The calling thread takes part in each batch, so `threads` includes it.
+	// Zero means one per hardware thread.
+	explicit WorkPool(size_t threads=0);
+	~WorkPool();
+
+	size_t threads() const { return mThreadCount; }
+
+	// Calls job(i) for every i from zero up to (but not including) `count`,
+	// and returns once all the calls have. The order they're made in, and
+	// the threads they're made on, are unspecified. The job mustn't throw.
+	void run(size_t count, const Job& job);
+
+	private:
+	struct Share {
+		boost::mutex lock;
+		size_t next, end;
+	};
+
+	void _worker(size_t self);
+	void _work(size_t self);
+	bool _take(size_t self, size_t& job);
+	bool _steal(size_t self, size_t& job);
+
+	const size_t mThreadCount;
+	boost::scoped_array<Share> mShares;
+	boost::thread_group mThreads;
+
+	boost::mutex mRunLock; // Held for the whole of a run()
+	boost::mutex mLock;
+	boost::condition_variable mWake, mDone;
+	unsigned long mBatch;
+	size_t mBusy;
+	bool mStopping;
+	const Job *mJob;
+};
+
+} // namespace markdown
+
+#endif // MARKDOWN_POOL_H_INCLUDED
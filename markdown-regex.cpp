@@ -0,0 +1,42 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#include "markdown-regex.h"
+
+namespace markdown {
+
+const LazyRegex *LazyRegex::sFirst=0;
+
+LazyRegex::LazyRegex(const std::string& pattern): mPattern(pattern),
+	mCompiled(0), mNext(sFirst)
+{
+	sFirst=this;
+}
+
+LazyRegex::~LazyRegex() {
+	delete mCompiled.load(boost::memory_order_relaxed);
+}
+
+const boost::regex& LazyRegex::get() const {
+	const boost::regex *r=mCompiled.load(boost::memory_order_acquire);
+	if (r==0) {
+		// Two threads may both compile it; the first to publish wins and the
+		// other throws its copy away.
+		const boost::regex *compiled=new boost::regex(mPattern);
+		if (mCompiled.compare_exchange_strong(r, compiled,
+			boost::memory_order_acq_rel, boost::memory_order_acquire))
+		{
+			r=compiled;
+		} else delete compiled;
+	}
+	return *r;
+}
+
+void LazyRegex::compileAll() {
+	for (const LazyRegex *i=sFirst; i!=0; i=i->mNext) i->get();
+}
+
+} // namespace markdown
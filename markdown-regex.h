@@ -0,0 +1,45 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_REGEX_H_INCLUDED
+#define MARKDOWN_REGEX_H_INCLUDED
+
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/regex.hpp>
+#include <boost/atomic.hpp>
+
+namespace markdown {
+
+// A regular expression that isn't compiled until it's first used. Declaring
+// one only stores the pattern, so the engine's expressions cost nothing at
+// load time; the first get() compiles it, and is safe to call from several
+// threads at once.
+//
+// Only define these at namespace scope: each one adds itself to a list at
+// static-initialization time, which is what lets compileAll() find them.
+class LazyRegex: private boost::noncopyable {
+	public:
+	explicit LazyRegex(const std::string& pattern);
+	~LazyRegex();
+
+	const boost::regex& get() const;
+
+	// Compiles every LazyRegex in the program that hasn't been used yet.
+	static void compileAll();
+
+	private:
+	const std::string mPattern;
+	mutable boost::atomic<const boost::regex*> mCompiled;
+	const LazyRegex *mNext;
+
+	static const LazyRegex *sFirst;
+};
+
+} // namespace markdown
+
+#endif // MARKDOWN_REGEX_H_INCLUDED
@@ -0,0 +1,124 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#include "markdown-render.h"
+
+namespace markdown {
+
+void EventFanout::enterBlock(Block type, size_t level, const SourceRange&
+	lines)
+{
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->enterBlock(type, level, lines);
+}
+
+void EventFanout::exitBlock(Block type, const SourceRange& lines) {
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->exitBlock(type, lines);
+}
+
+void EventFanout::enterSpan(Span type, const std::string& url, const
+	std::string& title, const SourceRange& lines)
+{
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->enterSpan(type, url, title, lines);
+}
+
+void EventFanout::exitSpan(Span type, const SourceRange& lines) {
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->exitSpan(type, lines);
+}
+
+void EventFanout::text(const std::string& text, const SourceRange& lines) {
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->text(text, lines);
+}
+
+void EventFanout::code(const std::string& text, bool block, const
+	SourceRange& lines)
+{
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->code(text, block, lines);
+}
+
+void EventFanout::html(const std::string& html, const SourceRange& lines) {
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->html(html, lines);
+}
+
+void EventFanout::image(const std::string& altText, const std::string& url,
+	const std::string& title, const SourceRange& lines)
+{
+	for (Handlers::const_iterator i=mHandlers.begin(), ie=mHandlers.end();
+		i!=ie; ++i) (*i)->image(altText, url, title, lines);
+}
+
+
+
+void TextRenderer::enterBlock(Block type, size_t level, const SourceRange&
+	lines)
+{
+	_endLine();
+}
+
+void TextRenderer::exitBlock(Block type, const SourceRange& lines) {
+	_endLine();
+}
+
+void TextRenderer::text(const std::string& text, const SourceRange& lines) {
+	if (text.empty()) return;
+	mOut << text;
+	mPending=(text[text.length()-1]!='\n');
+}
+
+void TextRenderer::code(const std::string& text, bool block, const
+	SourceRange& lines)
+{
+	if (block) _endLine();
+	if (!text.empty()) {
+		mOut << text;
+		mPending=(text[text.length()-1]!='\n');
+	}
+	if (block) _endLine();
+}
+
+void TextRenderer::image(const std::string& altText, const std::string& url,
+	const std::string& title, const SourceRange& lines)
+{
+	if (altText.empty()) return;
+	mOut << altText;
+	mPending=(altText[altText.length()-1]!='\n');
+}
+
+void TextRenderer::_endLine() {
+	if (!mPending) return;
+	mOut << '\n';
+	mPending=false;
+}
+
+
+
+void OutlineRenderer::enterBlock(Block type, size_t level, const
+	SourceRange& lines)
+{
+	if (type==cHeader && mDepth==0) {
+		mHeadings.push_back(Heading(lines.first, level, std::string()));
+		mInHeader=true;
+	}
+	++mDepth;
+}
+
+void OutlineRenderer::exitBlock(Block type, const SourceRange& lines) {
+	--mDepth;
+	mInHeader=false;
+}
+
+void OutlineRenderer::text(const std::string& text, const SourceRange& lines)
+{
+	if (mInHeader) mHeadings.back().text+=text;
+}
+
+} // namespace markdown
@@ -0,0 +1,81 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_RENDER_H_INCLUDED
+#define MARKDOWN_RENDER_H_INCLUDED
+
+#include "markdown.h"
+
+#include <vector>
+
+namespace markdown {
+
+// Passes every event on to each of the handlers added to it, in the order
+// they were added, so one Document::write() (or feed()) can drive any number
+// of renderers off a single parse. The handlers aren't owned by it.
+class EventFanout: public EventHandler {
+	public:
+	void add(EventHandler& handler) { mHandlers.push_back(&handler); }
+
+	virtual void enterBlock(Block type, size_t level, const SourceRange& lines);
+	virtual void exitBlock(Block type, const SourceRange& lines);
+	virtual void enterSpan(Span type, const std::string& url, const
+		std::string& title, const SourceRange& lines);
+	virtual void exitSpan(Span type, const SourceRange& lines);
+	virtual void text(const std::string& text, const SourceRange& lines);
+	virtual void code(const std::string& text, bool block, const SourceRange&
+		lines);
+	virtual void html(const std::string& html, const SourceRange& lines);
+	virtual void image(const std::string& altText, const std::string& url,
+		const std::string& title, const SourceRange& lines);
+
+	private:
+	typedef std::vector<EventHandler*> Handlers;
+
+	Handlers mHandlers;
+};
+
+// Writes the document as plain text, for search indexes and the like: the
+// text of the headers, paragraphs, list items and code, with a line break
+// after each of them, and the alt text of images. Raw HTML is left out.
+class TextRenderer: public EventHandler {
+	public:
+	TextRenderer(std::ostream& out): mOut(out), mPending(false) { }
+
+	virtual void enterBlock(Block type, size_t level, const SourceRange& lines);
+	virtual void exitBlock(Block type, const SourceRange& lines);
+	virtual void text(const std::string& text, const SourceRange& lines);
+	virtual void code(const std::string& text, bool block, const SourceRange&
+		lines);
+	virtual void image(const std::string& altText, const std::string& url,
+		const std::string& title, const SourceRange& lines);
+
+	private:
+	void _endLine();
+
+	std::ostream& mOut;
+	bool mPending; // Text written since the last line break
+};
+
+// Collects the top-level headers, the way Document::outline() finds them.
+class OutlineRenderer: public EventHandler {
+	public:
+	OutlineRenderer(std::vector<Heading>& headings): mHeadings(headings),
+		mDepth(0), mInHeader(false) { }
+
+	virtual void enterBlock(Block type, size_t level, const SourceRange& lines);
+	virtual void exitBlock(Block type, const SourceRange& lines);
+	virtual void text(const std::string& text, const SourceRange& lines);
+
+	private:
+	std::vector<Heading>& mHeadings;
+	size_t mDepth;
+	bool mInHeader;
+};
+
+} // namespace markdown
+
+#endif // MARKDOWN_RENDER_H_INCLUDED
@@ -5,12 +5,14 @@
 	See the provided LICENSE.TXT file for details.
 */
 #include "markdown-tokens.h"
+#include "markdown-regex.h"
 
 #include <stack>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
 #include <boost/unordered_set.hpp>
+#include <boost/thread/once.hpp>
 
 using std::cerr;
 using std::endl;
@@ -34,6 +36,8 @@ char escapedCharacter(size_t index) {
 	return cEscapedCharacters[index];
 }
 
+const LazyRegex cIgnore("^(&amp;)|(&#[0-9]{1,3};)|(&#[xX][0-9a-fA-F]{1,2};)");
+
 std::string encodeString(const std::string& src, int encodingFlags) {
 	bool amps=(encodingFlags & cAmps)!=0,
 		doubleAmps=(encodingFlags & cDoubleAmps)!=0,
@@ -43,8 +47,7 @@ std::string encodeString(const std::string& src, int encodingFlags) {
 	std::string tgt;
 	for (std::string::const_iterator i=src.begin(), ie=src.end(); i!=ie; ++i) {
 		if (*i=='&' && amps) {
-			static const boost::regex cIgnore("^(&amp;)|(&#[0-9]{1,3};)|(&#[xX][0-9a-fA-F]{1,2};)");
-			if (boost::regex_search(i, ie, cIgnore)) {
+			if (boost::regex_search(i, ie, cIgnore.get())) {
 				tgt.push_back(*i);
 			} else {
 				tgt+="&amp;";
@@ -155,6 +158,7 @@ const char *cBlockTagInit[]={ "p/", "blockquote/", "hr", "h1/", "h2/",
 //"legend", "noscript", "optgroup", "xmp",
 
 boost::unordered_set<std::string> otherTags, blockTags;
+boost::once_flag tagsInitialized=BOOST_ONCE_INIT;
 
 void initTag(boost::unordered_set<std::string> &set, const char *init[]) {
 	for (size_t x=0; init[x]!=0; ++x) {
@@ -167,6 +171,11 @@ void initTag(boost::unordered_set<std::string> &set, const char *init[]) {
 	}
 }
 
+void initTags() {
+	initTag(otherTags, cOtherTagInit);
+	initTag(blockTags, cBlockTagInit);
+}
+
 std::string cleanTextLinkRef(const std::string& ref) {
 	std::string r;
 	for (std::string::const_iterator i=ref.begin(), ie=ref.end(); i!=ie;
@@ -184,10 +193,7 @@ std::string cleanTextLinkRef(const std::string& ref) {
 
 
 size_t isValidTag(const std::string& tag, bool nonBlockFirst) {
-	if (blockTags.empty()) {
-		initTag(otherTags, cOtherTagInit);
-		initTag(blockTags, cBlockTagInit);
-	}
+	boost::call_once(tagsInitialized, initTags);
 
 	if (nonBlockFirst) {
 		if (otherTags.find(tag)!=otherTags.end()) return 1;
@@ -211,7 +217,15 @@ void TextHolder::writeAsHtml(std::ostream& out) const {
 	postWrite(out);
 }
 
-optional<TokenGroup> RawText::processSpanElements(const LinkIds& idTable) {
+void TextHolder::writeAsEvents(EventHandler& h, const SourceRange& lines) const {
+	preEvents(h, lines);
+	h.text(mText, lines);
+	postEvents(h, lines);
+}
+
+optional<TokenGroup> RawText::processSpanElements(const LinkIds& idTable,
+	const Cancellation *cancel)
+{
 	if (!canContainMarkup()) return none;
 
 	ReplacementTable replacements;
@@ -222,6 +236,9 @@ optional<TokenGroup> RawText::processSpanElements(const LinkIds& idTable) {
 	return _processBoldAndItalicSpans(str, replacements);
 }
 
+const LazyRegex cHtmlToken("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))+? */? *))>"),
+	cAttributeStrings("= ?(\"|').*?\\1");
+
 std::string RawText::_processHtmlTagAttributes(std::string src, ReplacementTable&
 	replacements)
 {
@@ -229,9 +246,8 @@ std::string RawText::_processHtmlTagAttributes(std::string src, ReplacementTable
 	std::string tgt;
 	std::string::const_iterator prev=src.begin(), end=src.end();
 	while (1) {
-		static const boost::regex cHtmlToken("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))+? */? *))>");
 		boost::smatch m;
-		if (boost::regex_search(prev, end, m, cHtmlToken)) {
+		if (boost::regex_search(prev, end, m, cHtmlToken.get())) {
 			// NOTE: Kludge alert! The `isValidTag` test is a cheat, only here
 			// to handle some edge cases between the Markdown test suite and the
 			// PHP-Markdown one, which seem to conflict.
@@ -241,9 +257,8 @@ std::string RawText::_processHtmlTagAttributes(std::string src, ReplacementTable
 				std::string fulltag=m[0], tgttag;
 				std::string::const_iterator prevtag=fulltag.begin(), endtag=fulltag.end();
 				while (1) {
-					static const boost::regex cAttributeStrings("= ?(\"|').*?\\1");
 					boost::smatch mtag;
-					if (boost::regex_search(prevtag, endtag, mtag, cAttributeStrings)) {
+					if (boost::regex_search(prevtag, endtag, mtag, cAttributeStrings.get())) {
 						tgttag+=std::string(prevtag, mtag[0].first);
 						tgttag+="\x01@"+boost::lexical_cast<std::string>(replacements.size())+"@htmlTagAttr\x01";
 						prevtag=mtag[0].second;
@@ -269,19 +284,19 @@ std::string RawText::_processHtmlTagAttributes(std::string src, ReplacementTable
 	return tgt;
 }
 
+const LazyRegex cCodeSpanDouble("(?:^|(?<=[^\\\\]))`` (.+?) ``"),
+	cCodeSpanSingle("(?:^|(?<=[^\\\\]))`(.+?)`");
+const LazyRegex *const cCodeSpan[2]={ &cCodeSpanDouble, &cCodeSpanSingle };
+
 std::string RawText::_processCodeSpans(std::string src, ReplacementTable&
 	replacements)
 {
-	static const boost::regex cCodeSpan[2]={
-		boost::regex("(?:^|(?<=[^\\\\]))`` (.+?) ``"),
-		boost::regex("(?:^|(?<=[^\\\\]))`(.+?)`")
-	};
 	for (int pass=0; pass<2; ++pass) {
 		std::string tgt;
 		std::string::const_iterator prev=src.begin(), end=src.end();
 		while (1) {
 			boost::smatch m;
-			if (boost::regex_search(prev, end, m, cCodeSpan[pass])) {
+			if (boost::regex_search(prev, end, m, cCodeSpan[pass]->get())) {
 				tgt+=std::string(prev, m[0].first);
 				tgt+="\x01@"+boost::lexical_cast<std::string>(replacements.size())+"@codeSpan\x01";
 				prev=m[0].second;
@@ -322,16 +337,16 @@ std::string RawText::_processEscapedCharacters(const std::string& src) {
 	return tgt;
 }
 
+const LazyRegex cRemove("(?:(?: \\*+ )|(?: _+ ))");
+
 std::string RawText::_processSpaceBracketedGroupings(const std::string &src,
 	ReplacementTable& replacements)
 {
-	static const boost::regex cRemove("(?:(?: \\*+ )|(?: _+ ))");
-
 	std::string tgt;
 	std::string::const_iterator prev=src.begin(), end=src.end();
 	while (1) {
 		boost::smatch m;
-		if (boost::regex_search(prev, end, m, cRemove)) {
+		if (boost::regex_search(prev, end, m, cRemove.get())) {
 			tgt+=std::string(prev, m[0].first);
 			tgt+="\x01@"+boost::lexical_cast<std::string>(replacements.size())+"@spaceBracketed\x01";
 			replacements.push_back(TokenPtr(new RawText(m[0])));
@@ -344,30 +359,31 @@ std::string RawText::_processSpaceBracketedGroupings(const std::string &src,
 	return tgt;
 }
 
+// NOTE: Kludge alert! The "inline link or image" regex should be...
+//
+//   "(?:(!?)\\[(.+?)\\] *\\((.*?)\\))"
+//
+// ...but that fails on the 'Images' test because it includes a "stupid URL"
+// that has parentheses within it. The proper way to deal with this would be
+// to match any nested parentheses, but regular expressions can't handle an
+// unknown number of nested items, so I'm cheating -- the regex for it
+// allows for one (and *only* one) pair of matched parentheses within the
+// URL. It makes the regex hard to follow (it was even harder to get right),
+// but it allows it to pass the test.
+//
+// The "reference link or image" one has a similar problem; it should be...
+//
+//   "|(?:(!?)\\[(.+?)\\](?: *\\[(.*?)\\])?)"
+//
+const LazyRegex cLinkExpression(
+	"(?:(!?)\\[([^\\]]+?)\\] *\\(([^\\(]*(?:\\(.*?\\).*?)*?)\\))" // Inline link or image
+	"|(?:(!?)\\[((?:[^]]*?\\[.*?\\].*?)|(?:.+?))\\](?: *\\[(.*?)\\])?)" // Reference link or image
+	"|(?:<(/?([a-zA-Z0-9]+).*?)>)" // potential HTML tag or auto-link
+), cLinkReference("^<?([^ >]*)>?(?: *(?:('|\")(.*)\\2)|(?:\\((.*)\\)))? *$");
+
 std::string RawText::_processLinksImagesAndTags(const std::string &src,
 	ReplacementTable& replacements, const LinkIds& idTable)
 {
-	// NOTE: Kludge alert! The "inline link or image" regex should be...
-	//
-	//   "(?:(!?)\\[(.+?)\\] *\\((.*?)\\))"
-	//
-	// ...but that fails on the 'Images' test because it includes a "stupid URL"
-	// that has parentheses within it. The proper way to deal with this would be
-	// to match any nested parentheses, but regular expressions can't handle an
-	// unknown number of nested items, so I'm cheating -- the regex for it
-	// allows for one (and *only* one) pair of matched parentheses within the
-	// URL. It makes the regex hard to follow (it was even harder to get right),
-	// but it allows it to pass the test.
-	//
-	// The "reference link or image" one has a similar problem; it should be...
-	//
-	//   "|(?:(!?)\\[(.+?)\\](?: *\\[(.*?)\\])?)"
-	//
-	static const boost::regex cExpression(
-		"(?:(!?)\\[([^\\]]+?)\\] *\\(([^\\(]*(?:\\(.*?\\).*?)*?)\\))" // Inline link or image
-		"|(?:(!?)\\[((?:[^]]*?\\[.*?\\].*?)|(?:.+?))\\](?: *\\[(.*?)\\])?)" // Reference link or image
-		"|(?:<(/?([a-zA-Z0-9]+).*?)>)" // potential HTML tag or auto-link
-	);
 	// Important captures: 1/4=image indicator, 2/5=contents/alttext,
 	// 3=URL/title, 6=optional link ID, 7=potential HTML tag or auto-link
 	// contents, 8=actual tag from 7.
@@ -376,7 +392,7 @@ std::string RawText::_processLinksImagesAndTags(const std::string &src,
 	std::string::const_iterator prev=src.begin(), end=src.end();
 	while (1) {
 		boost::smatch m;
-		if (boost::regex_search(prev, end, m, cExpression)) {
+		if (boost::regex_search(prev, end, m, cLinkExpression.get())) {
 			assert(m[0].matched);
 			assert(m[0].length()!=0);
 
@@ -401,12 +417,11 @@ std::string RawText::_processLinksImagesAndTags(const std::string &src,
 					optional<markdown::LinkIds::Target> target=idTable.find(linkId);
 					if (target) { url=target->url; title=target->title; resolved=true; };
 				} else {
-					static const boost::regex cReference("^<?([^ >]*)>?(?: *(?:('|\")(.*)\\2)|(?:\\((.*)\\)))? *$");
 					// Useful captures: 1=url, 3/4=title
 					contentsOrAlttext=m[2];
 					std::string urlAndTitle=m[3];
 					boost::smatch mm;
-					if (boost::regex_match(urlAndTitle, mm, cReference)) {
+					if (boost::regex_match(urlAndTitle, mm, cLinkReference.get())) {
 						url=mm[1];
 						if (mm[3].matched) title=mm[3];
 						else if (mm[4].matched) title=mm[4];
@@ -426,7 +441,7 @@ std::string RawText::_processLinksImagesAndTags(const std::string &src,
 					replacements.push_back(TokenPtr(new HtmlAnchorTag(url, title)));
 					tgt+=contentsOrAlttext;
 					tgt+="\x01@"+boost::lexical_cast<std::string>(replacements.size())+"@links&Images2\x01";
-					replacements.push_back(TokenPtr(new HtmlTag("/a")));
+					replacements.push_back(TokenPtr(new HtmlAnchorEndTag));
 				}
 			} else {
 				// Otherwise it's an HTML tag or auto-link.
@@ -439,13 +454,13 @@ std::string RawText::_processLinksImagesAndTags(const std::string &src,
 					TokenGroup subgroup;
 					subgroup.push_back(TokenPtr(new HtmlAnchorTag(contents)));
 					subgroup.push_back(TokenPtr(new RawText(contents, false)));
-					subgroup.push_back(TokenPtr(new HtmlTag("/a")));
+					subgroup.push_back(TokenPtr(new HtmlAnchorEndTag));
 					replacements.push_back(TokenPtr(new Container(subgroup)));
 				} else if (looksLikeEmailAddress(contents)) {
 					TokenGroup subgroup;
 					subgroup.push_back(TokenPtr(new HtmlAnchorTag(emailEncode("mailto:"+contents))));
 					subgroup.push_back(TokenPtr(new RawText(emailEncode(contents), false)));
-					subgroup.push_back(TokenPtr(new HtmlTag("/a")));
+					subgroup.push_back(TokenPtr(new HtmlAnchorEndTag));
 					replacements.push_back(TokenPtr(new Container(subgroup)));
 				} else if (isValidTag(m[8])) {
 					replacements.push_back(TokenPtr(new HtmlTag(_restoreProcessedItems(contents, replacements))));
@@ -462,21 +477,21 @@ std::string RawText::_processLinksImagesAndTags(const std::string &src,
 	return tgt;
 }
 
+const LazyRegex cEmphasisExpression(
+	"(?:(?<![*_])([*_]{1,3})([^*_ ]+?)\\1(?![*_]))"                                    // Mid-word emphasis
+	"|((?:(?<!\\*)\\*{1,3}(?!\\*)|(?<!_)_{1,3}(?!_))(?=.)(?! )(?![.,:;] )(?![.,:;]$))" // Open
+	"|((?<![* ])\\*{1,3}(?!\\*)|(?<![ _])_{1,3}(?!_))"                                 // Close
+);
+
 TokenGroup RawText::_processBoldAndItalicSpans(const std::string& src,
 	ReplacementTable& replacements)
 {
-	static const boost::regex cEmphasisExpression(
-		"(?:(?<![*_])([*_]{1,3})([^*_ ]+?)\\1(?![*_]))"                                    // Mid-word emphasis
-		"|((?:(?<!\\*)\\*{1,3}(?!\\*)|(?<!_)_{1,3}(?!_))(?=.)(?! )(?![.,:;] )(?![.,:;]$))" // Open
-		"|((?<![* ])\\*{1,3}(?!\\*)|(?<![ _])_{1,3}(?!_))"                                 // Close
-	);
-
 	TokenGroup tgt;
 	std::string::const_iterator i=src.begin(), end=src.end(), prev=i;
 
 	while (1) {
 		boost::smatch m;
-		if (boost::regex_search(prev, end, m, cEmphasisExpression)) {
+		if (boost::regex_search(prev, end, m, cEmphasisExpression.get())) {
 			if (prev!=m[0].first) tgt.push_back(TokenPtr(new
 				RawText(std::string(prev, m[0].first))));
 			if (m[3].matched) {
@@ -589,16 +604,17 @@ TokenGroup RawText::_processBoldAndItalicSpans(const std::string& src,
 	return r;
 }
 
+// The placeholders that the span passes leave in the text.
+const LazyRegex cReplaced("\x01@(#?[0-9]*)@.+?\x01");
+
 TokenGroup RawText::_encodeProcessedItems(const std::string &src,
 	ReplacementTable& replacements)
 {
-	static const boost::regex cReplaced("\x01@(#?[0-9]*)@.+?\x01");
-
 	TokenGroup r;
 	std::string::const_iterator prev=src.begin();
 	while (1) {
 		boost::smatch m;
-		if (boost::regex_search(prev, src.end(), m, cReplaced)) {
+		if (boost::regex_search(prev, src.end(), m, cReplaced.get())) {
 			std::string pre=std::string(prev, m[0].first);
 			if (!pre.empty()) r.push_back(TokenPtr(new RawText(pre)));
 			prev=m[0].second;
@@ -625,13 +641,11 @@ TokenGroup RawText::_encodeProcessedItems(const std::string &src,
 std::string RawText::_restoreProcessedItems(const std::string &src,
 	ReplacementTable& replacements)
 {
-	static const boost::regex cReplaced("\x01@(#?[0-9]*)@.+?\x01");
-
 	std::ostringstream r;
 	std::string::const_iterator prev=src.begin();
 	while (1) {
 		boost::smatch m;
-		if (boost::regex_search(prev, src.end(), m, cReplaced)) {
+		if (boost::regex_search(prev, src.end(), m, cReplaced.get())) {
 			std::string pre=std::string(prev, m[0].first);
 			if (!pre.empty()) r << pre;
 			prev=m[0].second;
@@ -658,7 +672,7 @@ std::string RawText::_restoreProcessedItems(const std::string &src,
 HtmlAnchorTag::HtmlAnchorTag(const std::string& url, const std::string& title):
 	TextHolder("<a href=\""+encodeString(url, cQuotes|cAmps)+"\""
 		+(title.empty() ? std::string() : " title=\""+encodeString(title, cQuotes|cAmps)+"\"")
-		+">", false, 0)
+		+">", false, 0), mUrl(url), mTitle(title)
 {
 	// This space deliberately blank. ;-)
 }
@@ -688,6 +702,16 @@ void Container::writeAsHtml(std::ostream& out) const {
 	postWrite(out);
 }
 
+void Container::writeAsEvents(EventHandler& h, const SourceRange& lines)
+	const
+{
+	const SourceRange& r=(mSourceRange.empty() ? lines : mSourceRange);
+	preEvents(h, r);
+	for (CTokenGroupIter i=mSubTokens.begin(), ie=mSubTokens.end(); i!=ie; ++i)
+		(*i)->writeAsEvents(h, r);
+	postEvents(h, r);
+}
+
 void Container::writeToken(size_t indent, std::ostream& out) const {
 	out << std::string(indent*2, ' ') << containerName() << endl;
 	for (CTokenGroupIter ii=mSubTokens.begin(), iie=mSubTokens.end(); ii!=iie;
@@ -695,23 +719,29 @@ void Container::writeToken(size_t indent, std::ostream& out) const {
 			(*ii)->writeToken(indent+1, out);
 }
 
-optional<TokenGroup> Container::processSpanElements(const LinkIds& idTable) {
+optional<TokenGroup> Container::processSpanElements(const LinkIds& idTable,
+	const Cancellation *cancel)
+{
 	TokenGroup t;
 	for (CTokenGroupIter ii=mSubTokens.begin(), iie=mSubTokens.end(); ii!=iie;
 		++ii)
 	{
+		checkCancelled(cancel);
 		if ((*ii)->text()) {
 			optional<TokenGroup> subt=(*ii)->processSpanElements(idTable);
 			if (subt) {
 				if (subt->size()>1) t.push_back(TokenPtr(new Container(*subt)));
 				else if (!subt->empty()) t.push_back(*subt->begin());
+				else continue;
+				t.back()->sourceRange((*ii)->sourceRange());
 			} else t.push_back(*ii);
 		} else {
-			optional<TokenGroup> subt=(*ii)->processSpanElements(idTable);
+			optional<TokenGroup> subt=(*ii)->processSpanElements(idTable, cancel);
 			if (subt) {
 				const Container *c=dynamic_cast<const Container*>((*ii).get());
 				assert(c!=0);
 				t.push_back(c->clone(*subt));
+				t.back()->sourceRange((*ii)->sourceRange());
 			} else t.push_back(*ii);
 		}
 	}
@@ -719,7 +749,13 @@ optional<TokenGroup> Container::processSpanElements(const LinkIds& idTable) {
 	return none;
 }
 
+void Container::mergeSourceRanges(const TokenGroup& tokens) {
+	for (CTokenGroupIter i=tokens.begin(), ie=tokens.end(); i!=ie; ++i)
+		mSourceRange.merge((*i)->sourceRange());
+}
+
 UnorderedList::UnorderedList(const TokenGroup& contents, bool paragraphMode) {
+	mergeSourceRanges(contents);
 	if (paragraphMode) {
 		// Change each of the text items into paragraphs
 		for (CTokenGroupIter i=contents.begin(), ie=contents.end(); i!=ie; ++i) {
@@ -746,6 +782,24 @@ void BoldOrItalicMarker::writeAsHtml(std::ostream& out) const {
 	}
 }
 
+void BoldOrItalicMarker::writeAsEvents(EventHandler& h, const SourceRange&
+	lines) const
+{
+	if (!mDisabled) {
+		if (mMatch!=0) {
+			assert(mSize>=1 && mSize<=3);
+			const std::string noLink;
+			if (mOpenMarker) {
+				if (mSize!=1) h.enterSpan(EventHandler::cStrong, noLink, noLink, lines);
+				if (mSize!=2) h.enterSpan(EventHandler::cEmphasis, noLink, noLink, lines);
+			} else {
+				if (mSize!=2) h.exitSpan(EventHandler::cEmphasis, lines);
+				if (mSize!=1) h.exitSpan(EventHandler::cStrong, lines);
+			}
+		} else h.text(std::string(mSize, mTokenCharacter), lines);
+	}
+}
+
 void BoldOrItalicMarker::writeToken(std::ostream& out) const {
 	if (!mDisabled) {
 		if (mMatch!=0) {
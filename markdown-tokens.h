@@ -17,6 +17,14 @@ namespace markdown {
 typedef TokenGroup::iterator TokenGroupIter;
 typedef TokenGroup::const_iterator CTokenGroupIter;
 
+// Thrown from the processing loops once their Cancellation is triggered, and
+// caught by the Document functions that were handed it.
+struct Cancelled { };
+
+inline void checkCancelled(const Cancellation *cancel) {
+	if (cancel!=0 && cancel->cancelled()) throw Cancelled();
+}
+
 class LinkIds {
 	public:
 	struct Target {
@@ -27,9 +35,16 @@ class LinkIds {
 			url(url_), title(title_) { }
 	};
 
+	LinkIds(): mMisses(0) { }
+
 	optional<Target> find(const std::string& id) const;
 	void add(const std::string& id, const std::string& url, const
 		std::string& title);
+	size_t size() const { return mTable.size(); }
+
+	// While it's set, find() adds the ids it can't find to `misses`. Only
+	// for when the table isn't being used by more than one thread.
+	void recordMisses(std::vector<std::string> *misses) { mMisses=misses; }
 
 	private:
 	typedef boost::unordered_map<std::string, Target> Table;
@@ -37,22 +52,26 @@ class LinkIds {
 	static std::string _scrubKey(std::string str);
 
 	Table mTable;
+	std::vector<std::string> *mMisses;
 };
 
 class Token {
 	public:
 	Token() { }
+	virtual ~Token() { }
 
 	virtual void writeAsHtml(std::ostream&) const=0;
 	virtual void writeAsOriginal(std::ostream& out) const { writeAsHtml(out); }
+	// `lines` are the source lines of the innermost block around it.
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const=0;
 	virtual void writeToken(std::ostream& out) const=0;
 	virtual void writeToken(size_t indent, std::ostream& out) const {
 		out << std::string(indent*2, ' ');
 		writeToken(out);
 	}
 
-	virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable)
-		{ return none; }
+	virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable,
+		const Cancellation *cancel=0) { return none; }
 
 	virtual optional<const std::string&> text() const { return none; }
 
@@ -65,9 +84,16 @@ class Token {
 	virtual bool isMatchedCloseMarker() const { return false; }
 	virtual bool inhibitParagraphs() const { return false; }
 
+	const SourceRange& sourceRange() const { return mSourceRange; }
+	void sourceRange(const SourceRange& r) { mSourceRange=r; }
+
 	protected:
 	virtual void preWrite(std::ostream& out) const { }
 	virtual void postWrite(std::ostream& out) const { }
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { }
+
+	SourceRange mSourceRange;
 };
 
 namespace token {
@@ -83,6 +109,7 @@ class TextHolder: public Token {
 		mEncodingFlags(encodingFlags) { }
 
 	virtual void writeAsHtml(std::ostream& out) const;
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const;
 
 	virtual void writeToken(std::ostream& out) const { out << "TextHolder: " << mText << '\n'; }
 
@@ -103,7 +130,8 @@ class RawText: public TextHolder {
 
 	virtual void writeToken(std::ostream& out) const { out << "RawText: " << *text() << '\n'; }
 
-	virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable);
+	virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable,
+		const Cancellation *cancel=0);
 
 	private:
 	typedef std::vector<TokenPtr> ReplacementTable;
@@ -123,6 +151,7 @@ class HtmlTag: public TextHolder {
 	public:
 	HtmlTag(const std::string& contents): TextHolder(contents, false, cAmps|cAngles) { }
 
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.html('<'+*text()+'>', lines); }
 	virtual void writeToken(std::ostream& out) const { out << "HtmlTag: " << *text() << '\n'; }
 
 	protected:
@@ -134,7 +163,19 @@ class HtmlAnchorTag: public TextHolder {
 	public:
 	HtmlAnchorTag(const std::string& url, const std::string& title=std::string());
 
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.enterSpan(EventHandler::cLink, mUrl, mTitle, lines); }
 	virtual void writeToken(std::ostream& out) const { out << "HtmlAnchorTag: " << *text() << '\n'; }
+
+	private:
+	const std::string mUrl, mTitle;
+};
+
+// The </a> that ends an HtmlAnchorTag's link.
+class HtmlAnchorEndTag: public HtmlTag {
+	public:
+	HtmlAnchorEndTag(): HtmlTag("/a") { }
+
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.exitSpan(EventHandler::cLink, lines); }
 };
 
 class InlineHtmlContents: public TextHolder {
@@ -142,6 +183,7 @@ class InlineHtmlContents: public TextHolder {
 	InlineHtmlContents(const std::string& contents): TextHolder(contents, false,
 		cAmps|cAngles) { }
 
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.html(*text(), lines); }
 	virtual void writeToken(std::ostream& out) const { out << "InlineHtmlContents: " << *text() << '\n'; }
 };
 
@@ -150,6 +192,7 @@ class InlineHtmlComment: public TextHolder {
 	InlineHtmlComment(const std::string& contents): TextHolder(contents, false,
 		0) { }
 
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.html(*text(), lines); }
 	virtual void writeToken(std::ostream& out) const { out << "InlineHtmlComment: " << *text() << '\n'; }
 };
 
@@ -159,6 +202,7 @@ class CodeBlock: public TextHolder {
 		false, cDoubleAmps|cAngles|cQuotes) { }
 
 	virtual void writeAsHtml(std::ostream& out) const;
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.code(*text(), true, lines); }
 
 	virtual void writeToken(std::ostream& out) const { out << "CodeBlock: " << *text() << '\n'; }
 };
@@ -170,6 +214,7 @@ class CodeSpan: public TextHolder {
 
 	virtual void writeAsHtml(std::ostream& out) const;
 	virtual void writeAsOriginal(std::ostream& out) const;
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.code(*text(), false, lines); }
 	virtual void writeToken(std::ostream& out) const { out << "CodeSpan: " << *text() << '\n'; }
 };
 
@@ -183,9 +228,13 @@ class Header: public TextHolder {
 
 	virtual bool inhibitParagraphs() const { return true; }
 
+	size_t level() const { return mLevel; }
+
 	protected:
 	virtual void preWrite(std::ostream& out) const { out << "<h" << mLevel << ">"; }
 	virtual void postWrite(std::ostream& out) const { out << "</h" << mLevel << ">\n"; }
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { h.enterBlock(EventHandler::cHeader, mLevel, lines); }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { h.exitBlock(EventHandler::cHeader, lines); }
 
 	private:
 	size_t mLevel;
@@ -196,6 +245,7 @@ class BlankLine: public TextHolder {
 	BlankLine(const std::string& actualContents=std::string()):
 		TextHolder(actualContents, false, 0) { }
 
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { }
 	virtual void writeToken(std::ostream& out) const { out << "BlankLine: " << *text() << '\n'; }
 
 	virtual bool isBlankLine() const { return true; }
@@ -209,6 +259,7 @@ class EscapedCharacter: public Token {
 
 	virtual void writeAsHtml(std::ostream& out) const { out << mChar; }
 	virtual void writeAsOriginal(std::ostream& out) const { out << '\\' << mChar; }
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.text(std::string(1, mChar), lines); }
 	virtual void writeToken(std::ostream& out) const { out << "EscapedCharacter: " << mChar << '\n'; }
 
 	private:
@@ -220,25 +271,33 @@ class EscapedCharacter: public Token {
 class Container: public Token {
 	public:
 	Container(const TokenGroup& contents=TokenGroup()): mSubTokens(contents),
-		mParagraphMode(false) { }
+		mParagraphMode(false) { mergeSourceRanges(contents); }
 
 	const TokenGroup& subTokens() const { return mSubTokens; }
-	void appendSubtokens(TokenGroup& tokens) { mSubTokens.splice(mSubTokens.end(), tokens); }
+	void appendSubtokens(TokenGroup& tokens) { mergeSourceRanges(tokens); mSubTokens.splice(mSubTokens.end(), tokens); }
 	void swapSubtokens(TokenGroup& tokens) { mSubTokens.swap(tokens); }
 
 	virtual bool isContainer() const { return true; }
 
 	virtual void writeAsHtml(std::ostream& out) const;
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const;
 
 	virtual void writeToken(std::ostream& out) const { out << "Container: error!" << '\n'; }
 	virtual void writeToken(size_t indent, std::ostream& out) const;
 
-	virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable);
+	virtual optional<TokenGroup> processSpanElements(const LinkIds& idTable,
+		const Cancellation *cancel=0);
 
 	virtual TokenPtr clone(const TokenGroup& newContents) const { return TokenPtr(new Container(newContents)); }
 	virtual std::string containerName() const { return "Container"; }
 
+	// The HTML that writeAsHtml() puts before and after the subtokens.
+	void writeOpening(std::ostream& out) const { preWrite(out); }
+	void writeClosing(std::ostream& out) const { postWrite(out); }
+
 	protected:
+	void mergeSourceRanges(const TokenGroup& tokens);
+
 	TokenGroup mSubTokens;
 	bool mParagraphMode;
 };
@@ -260,6 +319,10 @@ class InlineHtmlBlock: public Container {
 	// parsing purposes.
 	virtual bool isBlankLine() const { return true; }
 
+	protected:
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { h.enterBlock(EventHandler::cHtmlBlock, 0, lines); }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { h.exitBlock(EventHandler::cHtmlBlock, lines); }
+
 	private:
 	bool mIsBlockTag;
 };
@@ -279,6 +342,8 @@ class ListItem: public Container {
 	protected:
 	virtual void preWrite(std::ostream& out) const { out << "<li>"; }
 	virtual void postWrite(std::ostream& out) const { out << "</li>\n"; }
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { h.enterBlock(EventHandler::cListItem, 0, lines); }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { h.exitBlock(EventHandler::cListItem, lines); }
 
 	private:
 	bool mInhibitParagraphs;
@@ -294,6 +359,8 @@ class UnorderedList: public Container {
 	protected:
 	virtual void preWrite(std::ostream& out) const { out << "\n<ul>\n"; }
 	virtual void postWrite(std::ostream& out) const { out << "</ul>\n\n"; }
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { h.enterBlock(EventHandler::cUnorderedList, 0, lines); }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { h.exitBlock(EventHandler::cUnorderedList, lines); }
 };
 
 class OrderedList: public UnorderedList {
@@ -307,6 +374,8 @@ class OrderedList: public UnorderedList {
 	protected:
 	virtual void preWrite(std::ostream& out) const { out << "<ol>\n"; }
 	virtual void postWrite(std::ostream& out) const { out << "</ol>\n\n"; }
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { h.enterBlock(EventHandler::cOrderedList, 0, lines); }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { h.exitBlock(EventHandler::cOrderedList, lines); }
 };
 
 class BlockQuote: public Container {
@@ -319,6 +388,8 @@ class BlockQuote: public Container {
 	protected:
 	virtual void preWrite(std::ostream& out) const { out << "<blockquote>\n"; }
 	virtual void postWrite(std::ostream& out) const { out << "\n</blockquote>\n"; }
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { h.enterBlock(EventHandler::cBlockQuote, 0, lines); }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { h.exitBlock(EventHandler::cBlockQuote, lines); }
 };
 
 class Paragraph: public Container {
@@ -332,6 +403,8 @@ class Paragraph: public Container {
 	protected:
 	virtual void preWrite(std::ostream& out) const { out << "<p>"; }
 	virtual void postWrite(std::ostream& out) const { out << "</p>\n\n"; }
+	virtual void preEvents(EventHandler& h, const SourceRange& lines) const { h.enterBlock(EventHandler::cParagraph, 0, lines); }
+	virtual void postEvents(EventHandler& h, const SourceRange& lines) const { h.exitBlock(EventHandler::cParagraph, lines); }
 };
 
 
@@ -347,6 +420,7 @@ class BoldOrItalicMarker: public Token {
 	virtual bool isMatchedOpenMarker() const { return (mOpenMarker && mMatch!=0); }
 	virtual bool isMatchedCloseMarker() const { return (!mOpenMarker && mMatch!=0); }
 	virtual void writeAsHtml(std::ostream& out) const;
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const;
 	virtual void writeToken(std::ostream& out) const;
 
 	bool isOpenMarker() const { return mOpenMarker; }
@@ -376,6 +450,7 @@ class Image: public Token {
 		title): mAltText(altText), mUrl(url), mTitle(title) { }
 
 	virtual void writeAsHtml(std::ostream& out) const;
+	virtual void writeAsEvents(EventHandler& h, const SourceRange& lines) const { h.image(mAltText, mUrl, mTitle, lines); }
 
 	virtual void writeToken(std::ostream& out) const { out << "Image: " << mUrl << '\n'; }
 
@@ -7,13 +7,25 @@
 
 #include "markdown.h"
 #include "markdown-tokens.h"
+#include "markdown-regex.h"
+#include "markdown-pool.h"
+#include "markdown-binary.h"
 
 #include <sstream>
 #include <cassert>
+#include <algorithm>
+#include <deque>
 
 #include <boost/regex.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/case_conv.hpp>
+#include <boost/chrono.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/exception_ptr.hpp>
 
 using std::cerr;
 using std::endl;
@@ -22,6 +34,7 @@ using boost::optional;
 using boost::none;
 using markdown::TokenPtr;
 using markdown::CTokenGroupIter;
+using markdown::LazyRegex;
 
 namespace {
 
@@ -32,18 +45,102 @@ struct HtmlTagInfo {
 };
 
 const std::string cHtmlTokenSource("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))*? */? *))>");
-const boost::regex cHtmlTokenExpression(cHtmlTokenSource),
+const LazyRegex cHtmlTokenExpression(cHtmlTokenSource),
 	cStartHtmlTokenExpression("^"+cHtmlTokenSource),
 	cOneHtmlTokenExpression("^"+cHtmlTokenSource+"$");
 
+// The rest of the expressions, roughly in the order they're used below.
+const LazyRegex cHtmlCommentStartExpression("^<!--"),
+	cHtmlCommentEndExpression(".*-- *>$"),
+	cBlankLineExpression(" {0,3}(<--(.*)-- *> *)* *"),
+	cBlockQuoteExpression("^((?: {0,3}>)+) (.*)$"),
+	cUnorderedListExpression("^( *)([*+-]) +([^*-].*)$"),
+	cOrderedListExpression("^( *)([0-9]+)\\. +(.*)$"),
+	cContinuedItemExpression("^ *([^ ].*)$"),
+	cReferenceExpression("^ {0,3}\\[(.+)\\]: +<?([^ >]+)>?(?: *(?:('|\")(.*)\\3)|(?:\\((.*)\\)))?$"),
+	cSeparateTitleExpression("^ *(?:(?:('|\")(.*)\\1)|(?:\\((.*)\\))) *$"),
+	cHashHeadersExpression("^(#{1,6}) +(.*?) *#*$"),
+	cUnderlinedHeadersExpression("^([-=])\\1*$"),
+	cHorizontalRulesExpression("^ {0,3}((?:-|\\*|_) *){3,}$"),
+	cHtmlTokenStartExpression("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))*? */? *))$"),
+	cHtmlTokenEndExpression("^ *((?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\3))*? */? *))>"),
+	cLineBreakExpression("^(.*)  $");
+
 enum ParseHtmlTagFlags { cAlone, cStarts };
 
+// Recognizes "# Title" and "Title" over a line of "="s or "-"s without any of
+// the regex machinery, for the headings-only fallback. `underlined` says the
+// heading is the previous line.
+bool scanHeading(const std::string& line, const std::string& previousLine,
+	size_t& level, std::string& text, bool& underlined)
+{
+	if (line.empty()) return false;
+	if (line[0]=='#') {
+		size_t hashes=line.find_first_not_of('#');
+		if (hashes==std::string::npos) hashes=line.length();
+		if (hashes>6 || (hashes<line.length() && line[hashes]!=' ')) return false;
+		size_t first=line.find_first_not_of(' ', hashes),
+			last=line.find_last_not_of("# ");
+		level=hashes;
+		text=(first==std::string::npos || last==std::string::npos || last<first ?
+			std::string() : line.substr(first, last-first+1));
+		underlined=false;
+		return true;
+	}
+	if ((line[0]=='=' || line[0]=='-') &&
+		line.find_first_not_of(line[0])==std::string::npos)
+	{
+		size_t first=previousLine.find_first_not_of(' ');
+		if (first==std::string::npos) return false;
+		level=(line[0]=='=' ? 1 : 2);
+		text=previousLine.substr(first, previousLine.find_last_not_of(' ')-first+1);
+		underlined=true;
+		return true;
+	}
+	return false;
+}
+
+bool pastDeadline(const markdown::Cancellation::Clock::time_point *deadline) {
+	return (deadline!=0 && markdown::Cancellation::Clock::now()>=*deadline);
+}
+
+// Adds the time until it goes out of scope to `total`, in microseconds.
+class StageTimer {
+	public:
+	StageTimer(unsigned long long& total): mTotal(total),
+		mStart(boost::chrono::steady_clock::now()) { }
+	~StageTimer() {
+		mTotal+=boost::chrono::duration_cast<boost::chrono::microseconds>(
+			boost::chrono::steady_clock::now()-mStart).count();
+	}
+
+	private:
+	unsigned long long& mTotal;
+	boost::chrono::steady_clock::time_point mStart;
+};
+
+// The source lines covered by the line-tokens from `first` through `last`
+// (inclusive), or through the end of the group if `last` is `end`.
+markdown::SourceRange sourceLines(CTokenGroupIter first, CTokenGroupIter last,
+	CTokenGroupIter end)
+{
+	markdown::SourceRange r=(*first)->sourceRange();
+	if (last==end) --last;
+	r.merge((*last)->sourceRange());
+	return r;
+}
+
+TokenPtr fromLine(markdown::Token *token, CTokenGroupIter line) {
+	token->sourceRange((*line)->sourceRange());
+	return TokenPtr(token);
+}
+
 optional<HtmlTagInfo> parseHtmlTag(std::string::const_iterator begin,
 	std::string::const_iterator end, ParseHtmlTagFlags flags)
 {
 	boost::smatch m;
 	if (boost::regex_search(begin, end, m, (flags==cAlone ?
-		cOneHtmlTokenExpression : cStartHtmlTokenExpression)))
+		cOneHtmlTokenExpression : cStartHtmlTokenExpression).get()))
 	{
 		HtmlTagInfo r;
 		r.tagName=m[3];
@@ -60,7 +157,7 @@ markdown::TokenGroup parseInlineHtmlText(const std::string& src) {
 	std::string::const_iterator prev=src.begin(), end=src.end();
 	while (1) {
 		boost::smatch m;
-		if (boost::regex_search(prev, end, m, cHtmlTokenExpression)) {
+		if (boost::regex_search(prev, end, m, cHtmlTokenExpression.get())) {
 			if (prev!=m[0].first) {
 				//cerr << "  Non-tag (" << std::distance(prev, m[0].first) << "): " << std::string(prev, m[0].first) << endl;
 				r.push_back(TokenPtr(new markdown::token::InlineHtmlContents(std::string(prev, m[0].first))));
@@ -87,20 +184,17 @@ bool isHtmlCommentStart(std::string::const_iterator begin,
 {
 	// It can't be a single-line comment, those will already have been parsed
 	// by isBlankLine.
-	static const boost::regex cExpression("^<!--");
-	return boost::regex_search(begin, end, cExpression);
+	return boost::regex_search(begin, end, cHtmlCommentStartExpression.get());
 }
 
 bool isHtmlCommentEnd(std::string::const_iterator begin,
 	std::string::const_iterator end)
 {
-	static const boost::regex cExpression(".*-- *>$");
-	return boost::regex_match(begin, end, cExpression);
+	return boost::regex_match(begin, end, cHtmlCommentEndExpression.get());
 }
 
 bool isBlankLine(const std::string& line) {
-	static const boost::regex cExpression(" {0,3}(<--(.*)-- *> *)* *");
-	return boost::regex_match(line, cExpression);
+	return boost::regex_match(line, cBlankLineExpression.get());
 }
 
 optional<TokenPtr> parseInlineHtml(CTokenGroupIter& i, CTokenGroupIter end) {
@@ -238,18 +332,17 @@ size_t countQuoteLevel(const std::string& prefixString) {
 }
 
 optional<TokenPtr> parseBlockQuote(CTokenGroupIter& i, CTokenGroupIter end) {
-	static const boost::regex cBlockQuoteExpression("^((?: {0,3}>)+) (.*)$");
 	// Useful captures: 1=prefix, 2=content
 
 	if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
 		const std::string& line(*(*i)->text());
 		boost::smatch m;
-		if (boost::regex_match(line, m, cBlockQuoteExpression)) {
+		if (boost::regex_match(line, m, cBlockQuoteExpression.get())) {
 			size_t quoteLevel=countQuoteLevel(m[1]);
 			boost::regex continuationExpression=boost::regex("^((?: {0,3}>){"+boost::lexical_cast<std::string>(quoteLevel)+"}) ?(.*)$");
 
 			markdown::TokenGroup subTokens;
-			subTokens.push_back(TokenPtr(new markdown::token::RawText(m[2])));
+			subTokens.push_back(fromLine(new markdown::token::RawText(m[2]), i));
 
 			// The next line can be a continuation of this quote (with or
 			// without the prefix string) or a blank line. Blank lines are
@@ -264,25 +357,25 @@ optional<TokenPtr> parseBlockQuote(CTokenGroupIter& i, CTokenGroupIter end) {
 					if (ii==end) {
 						i=ii;
 						break;
-					} else {
+					} else if ((*ii)->text()) {
 						const std::string& line(*(*ii)->text());
 						if (boost::regex_match(line, m, continuationExpression)) {
 							if (m[1].matched && m[1].length()>0) {
+								subTokens.push_back(fromLine(new markdown::token::BlankLine, i));
+								subTokens.push_back(fromLine(new markdown::token::RawText(m[2]), ii));
 								i=++ii;
-								subTokens.push_back(TokenPtr(new markdown::token::BlankLine));
-								subTokens.push_back(TokenPtr(new markdown::token::RawText(m[2])));
 							} else break;
 						} else break;
-					}
-				} else {
+					} else break; // An HTML block, which ends the quote
+				} else if ((*i)->text()) {
 					const std::string& line(*(*i)->text());
 					if (boost::regex_match(line, m, continuationExpression)) {
 						assert(m[2].matched);
-						if (!isBlankLine(m[2])) subTokens.push_back(TokenPtr(new markdown::token::RawText(m[2])));
-						else subTokens.push_back(TokenPtr(new markdown::token::BlankLine(m[2])));
+						if (!isBlankLine(m[2])) subTokens.push_back(fromLine(new markdown::token::RawText(m[2]), i));
+						else subTokens.push_back(fromLine(new markdown::token::BlankLine(m[2]), i));
 						++i;
 					} else break;
-				}
+				} else break;
 			}
 
 			return TokenPtr(new markdown::token::BlockQuote(subTokens));
@@ -292,9 +385,6 @@ optional<TokenPtr> parseBlockQuote(CTokenGroupIter& i, CTokenGroupIter end) {
 }
 
 optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter end, bool sub=false) {
-	static const boost::regex cUnorderedListExpression("^( *)([*+-]) +([^*-].*)$");
-	static const boost::regex cOrderedListExpression("^( *)([0-9]+)\\. +(.*)$");
-
 	enum ListType { cNone, cUnordered, cOrdered };
 	ListType type=cNone;
 	if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
@@ -308,22 +398,22 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter end, bool
 		markdown::TokenGroup subTokens, subItemTokens;
 
 		boost::smatch m;
-		if (boost::regex_match(line, m, cUnorderedListExpression)) {
+		if (boost::regex_match(line, m, cUnorderedListExpression.get())) {
 			indent=m[1].length();
 			if (sub || indent<4) {
 				type=cUnordered;
 				char startChar=*m[2].first;
-				subItemTokens.push_back(TokenPtr(new markdown::token::RawText(m[3])));
+				subItemTokens.push_back(fromLine(new markdown::token::RawText(m[3]), i));
 
 				std::ostringstream next;
 				next << "^" << std::string(indent, ' ') << "\\" << startChar << " +([^*-].*)$";
 				nextItemExpression=next.str();
 			}
-		} else if (boost::regex_match(line, m, cOrderedListExpression)) {
+		} else if (boost::regex_match(line, m, cOrderedListExpression.get())) {
 			indent=m[1].length();
 			if (sub || indent<4) {
 				type=cOrdered;
-				subItemTokens.push_back(TokenPtr(new markdown::token::RawText(m[3])));
+				subItemTokens.push_back(fromLine(new markdown::token::RawText(m[3]), i));
 
 				std::ostringstream next;
 				next << "^" << std::string(indent, ' ') << "[0-9]+\\. +(.*)$";
@@ -351,7 +441,6 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter end, bool
 			// (more than the list itself), then it's another continuation of
 			// the current item. Otherwise it's either a new paragraph (and this
 			// list is ended) or the beginning of a sub-list.
-			static const boost::regex cContinuedItemExpression("^ *([^ ].*)$");
 
 			boost::regex continuedAfterBlankLineExpression("^ {"+
 				boost::lexical_cast<std::string>(indent+4)+"}([^ ].*)$");
@@ -386,37 +475,42 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter end, bool
 							nextItem=cAnotherItem;
 						} else if (boost::regex_match(line, m, continuedAfterBlankLineExpression)) {
 							assert(m[1].matched);
-							subItemTokens.push_back(TokenPtr(new markdown::token::BlankLine()));
-							subItemTokens.push_back(TokenPtr(new markdown::token::RawText(m[1])));
+							subItemTokens.push_back(fromLine(new markdown::token::BlankLine(), i));
+							subItemTokens.push_back(fromLine(new markdown::token::RawText(m[1]), ii));
 							i=++ii;
 							continue;
 						} else if (boost::regex_match(line, m, codeBlockAfterBlankLineExpression)) {
 							setParagraphMode=true;
 							++itemCount;
 							assert(m[1].matched);
-							subItemTokens.push_back(TokenPtr(new markdown::token::BlankLine()));
+							subItemTokens.push_back(fromLine(new markdown::token::BlankLine(), i));
 
 							std::string codeBlock=m[1]+'\n';
+							markdown::SourceRange codeLines=(*ii)->sourceRange();
 							++ii;
 							while (ii!=end) {
 								if ((*ii)->isBlankLine()) {
 									CTokenGroupIter iii=ii;
 									++iii;
+									if (iii==end || !(*iii)->text()) break;
 									const std::string& nextLine(*(*iii)->text());
 									if (boost::regex_match(nextLine, m, codeBlockAfterBlankLineExpression)) {
 										codeBlock+='\n'+m[1]+'\n';
+										codeLines.merge((*iii)->sourceRange());
 										ii=iii;
 									} else break;
 								} else if ((*ii)->text()) {
 									const std::string& line(*(*ii)->text());
 									if (boost::regex_match(line, m, codeBlockAfterBlankLineExpression)) {
 										codeBlock+=m[1]+'\n';
+										codeLines.merge((*ii)->sourceRange());
 									} else break;
 								} else break;
 								++ii;
 							}
 
 							subItemTokens.push_back(TokenPtr(new markdown::token::CodeBlock(codeBlock)));
+							subItemTokens.back()->sourceRange(codeLines);
 							i=ii;
 							continue;
 						} else {
@@ -434,15 +528,15 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter end, bool
 					} else if (boost::regex_match(line, m, nextItemExpression)) {
 						nextItem=cAnotherItem;
 					} else {
-						if (boost::regex_match(line, m, cUnorderedListExpression)
-							|| boost::regex_match(line, m, cOrderedListExpression))
+						if (boost::regex_match(line, m, cUnorderedListExpression.get())
+							|| boost::regex_match(line, m, cOrderedListExpression.get()))
 						{
 							// Belongs to the parent list
 							nextItem=cEndOfList;
 						} else {
-							boost::regex_match(line, m, cContinuedItemExpression);
+							boost::regex_match(line, m, cContinuedItemExpression.get());
 							assert(m[1].matched);
-							subItemTokens.push_back(TokenPtr(new markdown::token::RawText(m[1])));
+							subItemTokens.push_back(fromLine(new markdown::token::RawText(m[1]), i));
 							++i;
 							continue;
 						}
@@ -456,7 +550,7 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter end, bool
 
 				assert(nextItem!=cUnknown);
 				if (nextItem==cAnotherItem) {
-					subItemTokens.push_back(TokenPtr(new markdown::token::RawText(m[1])));
+					subItemTokens.push_back(fromLine(new markdown::token::RawText(m[1]), i));
 					++itemCount;
 					++i;
 				} else { // nextItem==cEndOfList
@@ -488,12 +582,11 @@ optional<TokenPtr> parseListBlock(CTokenGroupIter& i, CTokenGroupIter end, bool
 
 bool parseReference(CTokenGroupIter& i, CTokenGroupIter end, markdown::LinkIds &idTable) {
 	if ((*i)->text()) {
-		static const boost::regex cReference("^ {0,3}\\[(.+)\\]: +<?([^ >]+)>?(?: *(?:('|\")(.*)\\3)|(?:\\((.*)\\)))?$");
 		// Useful captures: 1=id, 2=url, 4/5=title
 
 		const std::string& line1(*(*i)->text());
 		boost::smatch m;
-		if (boost::regex_match(line1, m, cReference)) {
+		if (boost::regex_match(line1, m, cReferenceExpression.get())) {
 			std::string id(m[1]), url(m[2]), title;
 			if (m[4].matched) title=m[4];
 			else if (m[5].matched) title=m[5];
@@ -502,11 +595,10 @@ bool parseReference(CTokenGroupIter& i, CTokenGroupIter end, markdown::LinkIds &
 				++ii;
 				if (ii!=end && (*ii)->text()) {
 					// It could be on the next line
-					static const boost::regex cSeparateTitle("^ *(?:(?:('|\")(.*)\\1)|(?:\\((.*)\\))) *$");
 					// Useful Captures: 2/3=title
 
 					const std::string& line2(*(*ii)->text());
-					if (boost::regex_match(line2, m, cSeparateTitle)) {
+					if (boost::regex_match(line2, m, cSeparateTitleExpression.get())) {
 						++i;
 						title=(m[2].matched ? m[2] : m[3]);
 					}
@@ -520,13 +612,16 @@ bool parseReference(CTokenGroupIter& i, CTokenGroupIter end, markdown::LinkIds &
 	return false;
 }
 
-void flushParagraph(std::string& paragraphText, markdown::TokenGroup&
-	paragraphTokens, markdown::TokenGroup& finalTokens, bool noParagraphs)
+void flushParagraph(std::string& paragraphText, markdown::SourceRange&
+	paragraphLines, markdown::TokenGroup& paragraphTokens, markdown::TokenGroup&
+	finalTokens, bool noParagraphs)
 {
 	if (!paragraphText.empty()) {
 		paragraphTokens.push_back(TokenPtr(new markdown::token::RawText(paragraphText)));
+		paragraphTokens.back()->sourceRange(paragraphLines);
 		paragraphText.clear();
 	}
+	paragraphLines=markdown::SourceRange();
 
 	if (!paragraphTokens.empty()) {
 		if (noParagraphs) {
@@ -541,19 +636,17 @@ void flushParagraph(std::string& paragraphText, markdown::TokenGroup&
 optional<TokenPtr> parseHeader(CTokenGroupIter& i, CTokenGroupIter end) {
 	if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
 		// Hash-mark type
-		static const boost::regex cHashHeaders("^(#{1,6}) +(.*?) *#*$");
 		const std::string& line=*(*i)->text();
 		boost::smatch m;
-		if (boost::regex_match(line, m, cHashHeaders))
+		if (boost::regex_match(line, m, cHashHeadersExpression.get()))
 			return TokenPtr(new markdown::token::Header(m[1].length(), m[2]));
 
 		// Underlined type
 		CTokenGroupIter ii=i;
 		++ii;
 		if (ii!=end && !(*ii)->isBlankLine() && (*ii)->text() && (*ii)->canContainMarkup()) {
-			static const boost::regex cUnderlinedHeaders("^([-=])\\1*$");
 			const std::string& line=*(*ii)->text();
-			if (boost::regex_match(line, m, cUnderlinedHeaders)) {
+			if (boost::regex_match(line, m, cUnderlinedHeadersExpression.get())) {
 				char typeChar=std::string(m[1])[0];
 				TokenPtr p=TokenPtr(new markdown::token::Header((typeChar=='='
 					? 1 : 2), *(*i)->text()));
@@ -567,25 +660,308 @@ optional<TokenPtr> parseHeader(CTokenGroupIter& i, CTokenGroupIter end) {
 
 optional<TokenPtr> parseHorizontalRule(CTokenGroupIter& i, CTokenGroupIter end) {
 	if (!(*i)->isBlankLine() && (*i)->text() && (*i)->canContainMarkup()) {
-		static const boost::regex cHorizontalRules("^ {0,3}((?:-|\\*|_) *){3,}$");
 		const std::string& line=*(*i)->text();
-		if (boost::regex_match(line, cHorizontalRules)) {
+		if (boost::regex_match(line, cHorizontalRulesExpression.get())) {
 			return TokenPtr(new markdown::token::HtmlTag("hr/"));
 		}
 	}
 	return none;
 }
 
+// Whether the top-level tokens can be split into separately parsed chunks
+// between `blank` and `next`: that is, whether `next` starts something new
+// that none of the block parsers could take as part of whatever came before
+// the blank line. Lists, quotes and code blocks only continue past a blank
+// line with an indented, quoted or list item line; a setext underline needs
+// its text right above it; and inline HTML blocks (which can include blank
+// lines) have been turned into single tokens by the time this is used. The
+// blank line stays with the chunk before, since a list or quote that ends at
+// one takes it, whether what follows is the end of the input or not.
+bool isSafeBlockSplit(const TokenPtr& blank, const TokenPtr& next) {
+	if (!blank->isBlankLine()) return false;
+	if (next->isBlankLine() || !next->text() || !next->canContainMarkup())
+		return false;
+	const std::string& line=*next->text();
+	if (line.empty() || line[0]==' ' || line[0]=='\t' || line[0]=='>')
+		return false;
+	return (!boost::regex_match(line, cUnorderedListExpression.get()) &&
+		!boost::regex_match(line, cOrderedListExpression.get()));
+}
+
+// The same, for where convert()'s line splitting can end a chunk, before the
+// HTML tag, inline HTML and link definition passes have been over the lines.
+// `next` mustn't be a link definition, since that pass removes them (leaving
+// whatever follows next to the blank line), or start with a tag.
+bool isSafeLineSplit(const TokenPtr& blank, const TokenPtr& next) {
+	if (!isSafeBlockSplit(blank, next)) return false;
+	const std::string& line=*next->text();
+	return (line[0]!='<' && !boost::regex_match(line, cReferenceExpression.get()));
+}
+
+// A copy of a block that span processing can change without changing the
+// original: its containers are copied, all the way down, and the rest is
+// shared, since span processing only replaces those.
+TokenPtr unshared(const TokenPtr& block) {
+	const markdown::token::Container *c=dynamic_cast<const
+		markdown::token::Container*>(block.get());
+	if (c==0) return block;
+	markdown::TokenGroup contents;
+	for (CTokenGroupIter i=c->subTokens().begin(), ie=c->subTokens().end();
+		i!=ie; ++i) contents.push_back(unshared(*i));
+	TokenPtr r=c->clone(contents);
+	r->sourceRange(block->sourceRange());
+	return r;
+}
+
 } // namespace
 
 
 
 namespace markdown {
 
+// How far the processing passes have got. Each pass works through the
+// top-level tokens from `at` on, adding what it makes of them to `processed`,
+// and only replaces the tokens with those once it gets to the end.
+struct Document::PassState {
+	int pass; // 0 to 3, in the order _runPasses runs them; 4 once they're done
+	bool started;
+	CTokenGroupIter at;
+	TokenGroup processed;
+
+	// The paragraph pass's paragraph in progress.
+	std::string paragraphText;
+	SourceRange paragraphLines;
+	TokenGroup paragraphTokens;
+
+	PassState(): pass(0), started(false) { }
+
+	void nextPass() {
+		++pass;
+		started=false;
+		processed.clear();
+		paragraphText.clear();
+		paragraphLines=SourceRange();
+		paragraphTokens.clear();
+	}
+};
+
+// What the threads of convert() share. Each queue has one producer and one
+// consumer, and a null pointer marks its end. A stage that finds its queue
+// empty (or full) spins for a moment, since the other side is usually about
+// to catch up, then sleeps until some stage has pushed or popped something.
+struct Document::Pipeline {
+	typedef boost::lockfree::spsc_queue<TokenGroup*,
+		boost::lockfree::capacity<16> > ChunkQueue;
+	typedef boost::lockfree::spsc_queue<TokenPtr*,
+		boost::lockfree::capacity<1024> > BlockQueue;
+
+	static const int cSpins=64;
+
+	const Cancellation *cancel;
+	ChunkQueue chunks;  // Line splitting to block parsing
+	BlockQueue parsed;  // Block parsing to span processing
+	BlockQueue refined; // Span processing to writing
+
+	// Held by the line splitting while it adds link definitions, and by the
+	// span processing while it looks them up, until linksComplete is set;
+	// after that the table doesn't change.
+	boost::mutex linksLock;
+	// Set once the line splitting has seen every link definition.
+	boost::atomic<bool> linksComplete;
+	boost::atomic<bool> stop, cancelled;
+	boost::mutex errorLock;
+	boost::exception_ptr error;
+
+	boost::mutex waitLock;
+	boost::condition_variable changed;
+	boost::atomic<int> sleepers;
+
+	Pipeline(const Cancellation *cancel_): cancel(cancel_),
+		linksComplete(false), stop(false), cancelled(false), sleepers(0) { }
+
+	~Pipeline() {
+		TokenGroup *group;
+		while (chunks.pop(group)) delete group;
+		TokenPtr *block;
+		while (parsed.pop(block)) delete block;
+		while (refined.pop(block)) delete block;
+	}
+
+	// For a stage's catch block. The other stages give up at their next
+	// queue operation.
+	void halt(bool failed) {
+		if (failed) {
+			boost::lock_guard<boost::mutex> lock(errorLock);
+			if (!error) error=boost::current_exception();
+		} else cancelled=true;
+		stop=true;
+		boost::lock_guard<boost::mutex> lock(waitLock);
+		changed.notify_all();
+	}
+
+	// Wait while the queue is full (or empty); false if the pipeline was
+	// halted meanwhile.
+	template <typename Queue, typename T>
+	bool push(Queue& queue, T item) {
+		for (int spins=0; !queue.push(item); ++spins) {
+			if (stop.load(boost::memory_order_relaxed)) return false;
+			if (spins<cSpins) boost::this_thread::yield();
+			else _sleep(queue, true);
+		}
+		_wake();
+		return true;
+	}
+
+	template <typename Queue, typename T>
+	bool pop(Queue& queue, T& item) {
+		for (int spins=0; !queue.pop(item); ++spins) {
+			if (stop.load(boost::memory_order_relaxed)) return false;
+			if (spins<cSpins) boost::this_thread::yield();
+			else _sleep(queue, false);
+		}
+		_wake();
+		return true;
+	}
+
+	// Without waiting: false if the queue is empty.
+	template <typename Queue, typename T>
+	bool tryPop(Queue& queue, T& item) {
+		if (!queue.pop(item)) return false;
+		_wake();
+		return true;
+	}
+
+	private:
+	// The sleeper counts itself before it looks at the queue one last time,
+	// and the other side changes the queue before it looks at the count, with
+	// a full fence in between on both sides, so one of them always sees the
+	// other: either the sleeper finds the change, or it's woken for it.
+	template <typename Queue>
+	void _sleep(Queue& queue, bool pushing) {
+		boost::unique_lock<boost::mutex> lock(waitLock);
+		++sleepers;
+		boost::atomic_thread_fence(boost::memory_order_seq_cst);
+		while (!stop.load(boost::memory_order_relaxed) && (pushing ?
+			queue.write_available()==0 : queue.read_available()==0))
+				changed.wait(lock);
+		--sleepers;
+	}
+
+	void _wake() {
+		boost::atomic_thread_fence(boost::memory_order_seq_cst);
+		if (sleepers.load(boost::memory_order_relaxed)==0) return;
+		boost::lock_guard<boost::mutex> lock(waitLock);
+		changed.notify_all();
+	}
+};
+
+// WorkPool jobs mustn't throw: on a worker thread an exception would end the
+// program, and on the calling thread it would unwind run() while the workers
+// are still using the batch's state. So each job catches everything; a
+// cancellation stops the rest of the batch, and so does any other exception,
+// which is kept to be thrown again once run() has returned.
+struct Document::JobState {
+	boost::atomic<bool> stopped, cancelled;
+	boost::mutex errorLock;
+	boost::exception_ptr error;
+
+	JobState(): stopped(false), cancelled(false) { }
+
+	bool stopping() const { return stopped.load(boost::memory_order_relaxed); }
+
+	// For a job's catch blocks.
+	void halt(bool failed) {
+		if (failed) {
+			boost::lock_guard<boost::mutex> lock(errorLock);
+			if (!error) error=boost::current_exception();
+		} else cancelled.store(true, boost::memory_order_relaxed);
+		stopped.store(true, boost::memory_order_relaxed);
+	}
+
+	// After run(): throws what a job threw, if one did; otherwise tells
+	// whether one was cancelled.
+	bool wasCancelled() const {
+		if (error) boost::rethrow_exception(error);
+		return cancelled.load();
+	}
+};
+
+// Copies one run's HTML to its place in the concatenated output.
+void Document::_copyHtmlJob(const std::vector<std::string> *html, const
+	std::vector<size_t> *offsets, char *out, JobState *state, size_t job)
+{
+	try {
+		const std::string& h=(*html)[job];
+		if (!h.empty()) std::copy(h.begin(), h.end(), out+(*offsets)[job]);
+	} catch (...) {
+		state->halt(true);
+	}
+}
+
+// A streamed document's lines since the last place it could be split, and
+// the chunks of lines that have been parsed but not written yet, oldest
+// first. Those are kept as lines, not blocks, since span processing changes
+// blocks in place; a held-back chunk is parsed again when it's retried.
+struct Document::StreamState {
+	struct Chunk {
+		TokenGroup tokens;
+		size_t lines;
+		std::vector<std::string> misses; // Undefined ids, as of the last try
+
+		Chunk(const TokenGroup& tokens_, size_t lines_): tokens(tokens_),
+			lines(lines_) { }
+	};
+
+	std::string text; // Input after the last line break that's certain
+	TokenGroup lines;
+	size_t minLines;
+	std::deque<Chunk> waiting;
+	size_t waitingLines;
+
+	StreamState(): minLines(1), waitingLines(0) { }
+};
+
+void warmUp() {
+	LazyRegex::compileAll();
+	token::isValidTag(std::string());
+}
+
+void SourceIndex::build(const TokenGroup& blocks) {
+	clear();
+	mRanges.reserve(blocks.size());
+	for (CTokenGroupIter i=blocks.begin(), ie=blocks.end(); i!=ie; ++i) {
+		const SourceRange& r=(*i)->sourceRange();
+		if (!r.empty() && !((*i)->isBlankLine() && (*i)->text()))
+			mByLine.push_back(LineEntry(r.first, mRanges.size()));
+		mRanges.push_back(r);
+	}
+}
+
+void SourceIndex::clear() {
+	mRanges.clear();
+	mByLine.clear();
+}
+
+optional<size_t> SourceIndex::blockAtLine(size_t line) const {
+	std::vector<LineEntry>::const_iterator i=std::upper_bound(mByLine.begin(),
+		mByLine.end(), LineEntry(line, size_t(-1)));
+	if (i==mByLine.begin()) return none;
+	return (--i)->second;
+}
+
+SourceRange SourceIndex::linesOfBlock(size_t block) const {
+	if (block<mRanges.size()) return mRanges[block];
+	return SourceRange();
+}
+
+
+
 optional<LinkIds::Target> LinkIds::find(const std::string& id) const {
-	Table::const_iterator i=mTable.find(_scrubKey(id));
+	std::string key=_scrubKey(id);
+	Table::const_iterator i=mTable.find(key);
 	if (i!=mTable.end()) return i->second;
-	else return none;
+	if (mMisses!=0) mMisses->push_back(key);
+	return none;
 }
 
 void LinkIds::add(const std::string& id, const std::string& url, const
@@ -603,28 +979,37 @@ std::string LinkIds::_scrubKey(std::string str) {
 
 const size_t Document::cSpacesPerInitialTab=4; // Required by Markdown format
 const size_t Document::cDefaultSpacesPerTab=cSpacesPerInitialTab;
+const size_t Document::cMinChunkTokens=512;
+const size_t Document::cPipelineChunkLines=256;
+const size_t Document::cWriteRunsPerThread=4;
+const size_t StreamPolicy::cDefaultMaxDeferredLines=4096;
 
 Document::Document(size_t spacesPerTab): cSpacesPerTab(spacesPerTab),
-	mTokenContainer(new token::Container), mIdTable(new LinkIds),
-	mProcessed(false)
+	mTokenContainer(new token::Container), mIdTable(new LinkIds), mPool(0),
+	mPasses(0), mStream(0), mLineCount(0), mProcessed(false),
+	mCancelled(false), mOverBudget(cWithinBudget), mSourceBytes(0)
 {
 	// This space deliberately blank ;-)
 }
 
 Document::Document(std::istream& in, size_t spacesPerTab):
 	cSpacesPerTab(spacesPerTab), mTokenContainer(new token::Container),
-	mIdTable(new LinkIds), mProcessed(false)
+	mIdTable(new LinkIds), mPool(0), mPasses(0), mStream(0), mLineCount(0),
+	mProcessed(false), mCancelled(false),
+	mOverBudget(cWithinBudget), mSourceBytes(0)
 {
 	read(in);
 }
 
 Document::~Document() {
 	delete mIdTable;
+	delete mPasses;
+	delete mStream;
 }
 
-bool Document::read(const std::string& src) {
+bool Document::read(const std::string& src, const Cancellation *cancel) {
 	std::istringstream in(src);
-	return read(in);
+	return read(in, cancel);
 }
 
 bool Document::_getline(std::istream& in, std::string& line) {
@@ -653,66 +1038,1145 @@ bool Document::_getline(std::istream& in, std::string& line) {
 	return !line.empty();
 }
 
-bool Document::read(std::istream& in) {
-	if (mProcessed) return false;
+bool Document::read(std::istream& in, const Cancellation *cancel) {
+	if (mProcessed || mPasses!=0) return false;
 
 	token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
 	assert(tokens!=0);
 
-	std::string line;
+	StageTimer timer(mTimings.read);
+	std::string line, previousLine;
 	TokenGroup tgt;
+	size_t firstLine=mLineCount, sourceBytes=mSourceBytes,
+		fallbackBytes=mFallbackSource.length(),
+		fallbackHeadings=mFallbackHeadings.size();
+	bool overBudget=(mOverBudget!=cWithinBudget);
 	while (_getline(in, line)) {
-		if (isBlankLine(line)) {
-			tgt.push_back(TokenPtr(new token::BlankLine(line)));
-		} else {
-			tgt.push_back(TokenPtr(new token::RawText(line)));
+		if (cancel!=0 && cancel->cancelled()) {
+			mLineCount=firstLine;
+			mSourceBytes=sourceBytes;
+			mFallbackSource.resize(fallbackBytes);
+			mFallbackHeadings.erase(mFallbackHeadings.begin()+fallbackHeadings,
+				mFallbackHeadings.end());
+			return false;
+		}
+
+		mSourceBytes+=line.length()+1;
+		if (mBudget.limited()) _keepForFallback(line, previousLine, mLineCount);
+		if (!overBudget && mBudget.maxSourceBytes!=0 &&
+			mSourceBytes>mBudget.maxSourceBytes)
+		{
+			// No more tokens from here on, and none from this read.
+			overBudget=true;
+			tgt.clear();
 		}
+
+		if (!overBudget) {
+			if (isBlankLine(line)) {
+				tgt.push_back(TokenPtr(new token::BlankLine(line)));
+			} else {
+				tgt.push_back(TokenPtr(new token::RawText(line)));
+			}
+			tgt.back()->sourceRange(SourceRange(mLineCount, mLineCount+1));
+		}
+		++mLineCount;
+		previousLine.swap(line);
 	}
-	tokens->appendSubtokens(tgt);
 
+	if (!overBudget) {
+		tokens->appendSubtokens(tgt);
+	} else if (mOverBudget==cWithinBudget) {
+		// Let go of the tokens from earlier reads too.
+		mOverBudget=cOverMemoryBudget;
+		mTokenContainer.reset(new token::Container);
+	}
 	return true;
 }
 
-void Document::write(std::ostream& out) {
-	_process();
-	mTokenContainer->writeAsHtml(out);
+bool Document::write(std::ostream& out, const Cancellation *cancel) {
+	return write(out, 0, size_t(-1), cancel);
+}
+
+bool Document::write(std::ostream& out, size_t firstBlock, size_t lastBlock,
+	const Cancellation *cancel)
+{
+	if (!_process(cancel)) return false;
+	if (lastBlock>mBlocks.size()) lastBlock=mBlocks.size();
+	if (!_processSpans(firstBlock, lastBlock, cancel)) return false;
+	return _writeBlocks(&out, 0, firstBlock, lastBlock, cancel);
+}
+
+bool Document::write(EventHandler& handler, const Cancellation *cancel) {
+	return write(handler, 0, size_t(-1), cancel);
+}
+
+bool Document::write(EventHandler& handler, size_t firstBlock, size_t
+	lastBlock, const Cancellation *cancel)
+{
+	if (!_process(cancel)) return false;
+	if (lastBlock>mBlocks.size()) lastBlock=mBlocks.size();
+	if (!_processSpans(firstBlock, lastBlock, cancel)) return false;
+	return _writeBlocks(0, &handler, firstBlock, lastBlock, cancel);
+}
+
+bool Document::write(std::ostream& out, EventHandler& handler, const
+	Cancellation *cancel)
+{
+	return write(out, handler, 0, size_t(-1), cancel);
+}
+
+bool Document::write(std::ostream& out, EventHandler& handler, size_t
+	firstBlock, size_t lastBlock, const Cancellation *cancel)
+{
+	if (!_process(cancel)) return false;
+	if (lastBlock>mBlocks.size()) lastBlock=mBlocks.size();
+	if (!_processSpans(firstBlock, lastBlock, cancel)) return false;
+	return _writeBlocks(&out, &handler, firstBlock, lastBlock, cancel);
+}
+
+bool Document::writeSkeleton(std::ostream& out, size_t firstBlock, size_t
+	lastBlock, const Cancellation *cancel)
+{
+	if (!_process(cancel)) return false;
+	if (lastBlock>mBlocks.size()) lastBlock=mBlocks.size();
+	return _writeBlocks(&out, 0, firstBlock, lastBlock, cancel);
+}
+
+bool Document::write(std::ostream& out, const SourceRange& lines, const
+	Cancellation *cancel)
+{
+	if (!_process(cancel)) return false;
+	if (lines.empty()) return true;
+	optional<size_t> last=mSourceIndex.blockAtLine(lines.last-1);
+	if (!last) return true; // All of them are before the first block
+
+	// A line between blocks maps to the one before it, which isn't wanted
+	// here.
+	optional<size_t> first=mSourceIndex.blockAtLine(lines.first);
+	size_t firstBlock=(first ? *first : 0);
+	if (first && mSourceIndex.linesOfBlock(*first).last<=lines.first) ++firstBlock;
+	return write(out, firstBlock, *last+1, cancel);
+}
+
+bool Document::convert(std::istream& in, std::ostream& out, const
+	Cancellation *cancel)
+{
+	if (mLineCount!=0 || mProcessed || mPasses!=0 || mBudget.limited())
+		return (read(in, cancel) && write(out, cancel));
+
+	Pipeline p(cancel);
+	boost::thread reader(boost::bind(&Document::_readStage, this,
+		boost::ref(p), boost::ref(in)));
+	boost::thread parser(boost::bind(&Document::_blockStage, this,
+		boost::ref(p)));
+	boost::thread refiner(boost::bind(&Document::_spanStage, this,
+		boost::ref(p)));
+	_writeStage(p, out);
+	reader.join();
+	parser.join();
+	refiner.join();
+
+	if (p.error || p.cancelled) {
+		// The stages were stopped partway, so there's no document to speak of.
+		mCancelled=true;
+		if (p.error) boost::rethrow_exception(p.error);
+		return false;
+	}
+
+	token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
+	assert(tokens!=0);
+	TokenGroup blocks(mBlocks.begin(), mBlocks.end());
+	tokens->swapSubtokens(blocks);
+	mSpansProcessed.assign(mBlocks.size(), true);
+	mSourceIndex.build(tokens->subTokens());
+	mProcessed=true;
+	return true;
+}
+
+void Document::_readStage(Pipeline& p, std::istream& in) {
+	try {
+		std::string line;
+		TokenGroup lines;
+		TokenPtr next;
+		size_t minLines=cPipelineChunkLines;
+		bool more=true;
+		while (more) {
+			{
+				StageTimer timer(mTimings.read);
+				if (next) lines.push_back(next);
+				next.reset();
+				while ((more=_getline(in, line))) {
+					checkCancelled(p.cancel);
+					TokenPtr t;
+					if (isBlankLine(line)) t.reset(new token::BlankLine(line));
+					else t.reset(new token::RawText(line));
+					t->sourceRange(SourceRange(mLineCount, mLineCount+1));
+					++mLineCount;
+					mSourceBytes+=line.length()+1;
+
+					// Input that's slow in coming (a pipe, say) doesn't wait for a
+					// whole chunk's worth, so the blocks so far aren't held up.
+					if ((lines.size()>=minLines || (minLines==cPipelineChunkLines &&
+						in.rdbuf()->in_avail()<=0)) && !lines.empty() &&
+						isSafeLineSplit(lines.back(), t))
+					{
+						next=t;
+						break;
+					}
+					lines.push_back(t);
+				}
+			}
+			if (lines.empty()) break;
+
+			TokenPtr chunk(new token::Container(lines));
+			PassState merge, inlineHtml;
+			{
+				StageTimer timer(mTimings.mergeHtmlTags);
+				_mergeMultilineHtmlTags(chunk, merge, p.cancel, 0);
+			}
+			{
+				StageTimer timer(mTimings.inlineHtmlAndReferences);
+				boost::lock_guard<boost::mutex> lock(p.linksLock);
+				_processInlineHtmlAndReferences(chunk, inlineHtml, p.cancel, 0);
+			}
+
+			const TokenGroup& done=dynamic_cast<token::Container*>(chunk.get())->subTokens();
+			if (more && (done.empty() || done.back()!=lines.back())) {
+				// An inline HTML block took the blank line at the end, so it
+				// may go on past it. Parse these lines again along with the
+				// next ones; waiting for as many again each time keeps a long
+				// block from being parsed over and over.
+				minLines=lines.size()*2;
+				continue;
+			}
+			minLines=cPipelineChunkLines;
+
+			TokenGroup *group=new TokenGroup(done);
+			if (!p.push(p.chunks, group)) {
+				delete group;
+				return;
+			}
+			lines.clear();
+		}
+
+		p.linksComplete.store(true, boost::memory_order_release);
+		p.push(p.chunks, static_cast<TokenGroup*>(0));
+	} catch (Cancelled&) {
+		p.halt(false);
+	} catch (...) {
+		p.halt(true);
+	}
+}
+
+void Document::_blockStage(Pipeline& p) {
+	try {
+		for (;;) {
+			TokenGroup *group;
+			if (!p.pop(p.chunks, group)) return;
+			if (group==0) break;
+			TokenPtr chunk(new token::Container(*group));
+			delete group;
+
+			PassState blocks, paragraphs;
+			{
+				StageTimer timer(mTimings.blocks);
+				_processBlocksItems(chunk, blocks, p.cancel, 0);
+			}
+			{
+				StageTimer timer(mTimings.paragraphs);
+				_processParagraphLines(chunk, paragraphs, p.cancel, 0);
+			}
+
+			const TokenGroup& done=dynamic_cast<token::Container*>(chunk.get())->subTokens();
+			for (CTokenGroupIter i=done.begin(), ie=done.end(); i!=ie; ++i) {
+				TokenPtr *block=new TokenPtr(*i);
+				if (!p.push(p.parsed, block)) {
+					delete block;
+					return;
+				}
+			}
+		}
+		p.push(p.parsed, static_cast<TokenPtr*>(0));
+	} catch (Cancelled&) {
+		p.halt(false);
+	} catch (...) {
+		p.halt(true);
+	}
+}
+
+void Document::_spanStage(Pipeline& p) {
+	// A block waits here, rather than in the queue, while it refers to a link
+	// that hasn't been defined yet (the definition may be further down), and
+	// those after it wait behind it, so the stages before keep going.
+	std::deque<TokenPtr> waiting;
+	std::vector<std::string> misses; // The first waiting block's, if tried
+	try {
+		bool ended=false;
+		for (;;) {
+			while (!waiting.empty()) {
+				TokenPtr block=waiting.front();
+				{
+					StageTimer timer(mTimings.spans);
+					if (!_refinedEarly(p, block, misses)) break;
+				}
+				waiting.pop_front();
+				misses.clear();
+				TokenPtr *refined=new TokenPtr(block);
+				if (!p.push(p.refined, refined)) {
+					delete refined;
+					return;
+				}
+			}
+			if (ended) break;
+
+			TokenPtr *item;
+			if (!p.pop(p.parsed, item)) return;
+			if (item!=0) {
+				waiting.push_back(*item);
+				delete item;
+			} else ended=true;
+		}
+		p.push(p.refined, static_cast<TokenPtr*>(0));
+	} catch (Cancelled&) {
+		p.halt(false);
+	} catch (...) {
+		p.halt(true);
+	}
+}
+
+bool Document::_refinedEarly(Pipeline& p, TokenPtr& block,
+	std::vector<std::string>& misses)
+{
+	if (p.linksComplete.load(boost::memory_order_acquire)) {
+		block=_refined(block, p.cancel);
+		return true;
+	}
+
+	boost::lock_guard<boost::mutex> lock(p.linksLock);
+	for (size_t i=0; i<misses.size(); ++i)
+		if (!mIdTable->find(misses[i])) return false;
+
+	// Span processing changes containers in place, so it's done on a copy
+	// that can be thrown away if a reference is missing. A definition that
+	// comes later can't change the ones found now, since the first one for
+	// an id is the one that counts.
+	std::vector<std::string> found;
+	mIdTable->recordMisses(&found);
+	TokenPtr r;
+	try {
+		r=_refined(unshared(block), p.cancel);
+	} catch (...) {
+		mIdTable->recordMisses(0);
+		throw;
+	}
+	mIdTable->recordMisses(0);
+	if (!found.empty()) {
+		misses.swap(found);
+		return false;
+	}
+	block=r;
+	return true;
+}
+
+void Document::_writeStage(Pipeline& p, std::ostream& out) {
+	try {
+		for (;;) {
+			TokenPtr *item;
+			if (!p.tryPop(p.refined, item)) {
+				// Let what's been written so far out before waiting for more.
+				out.flush();
+				if (!p.pop(p.refined, item)) return;
+			}
+			if (item==0) break;
+			TokenPtr block=*item;
+			delete item;
+
+			checkCancelled(p.cancel);
+			StageTimer timer(mTimings.write);
+			block->writeAsHtml(out);
+			mBlocks.push_back(block);
+		}
+	} catch (Cancelled&) {
+		p.halt(false);
+	} catch (...) {
+		p.halt(true);
+	}
+}
+
+bool Document::feed(std::ostream& out, const std::string& text, const
+	Cancellation *cancel)
+{
+	return _feed(StreamOutput(&out, 0), text, cancel);
+}
+
+bool Document::feed(EventHandler& handler, const std::string& text, const
+	Cancellation *cancel)
+{
+	return _feed(StreamOutput(0, &handler), text, cancel);
+}
+
+bool Document::finish(std::ostream& out, const Cancellation *cancel) {
+	return _finish(StreamOutput(&out, 0), cancel);
+}
+
+bool Document::finish(EventHandler& handler, const Cancellation *cancel) {
+	return _finish(StreamOutput(0, &handler), cancel);
+}
+
+bool Document::feed(std::ostream& out, EventHandler& handler, const
+	std::string& text, const Cancellation *cancel)
+{
+	return _feed(StreamOutput(&out, &handler), text, cancel);
+}
+
+bool Document::finish(std::ostream& out, EventHandler& handler, const
+	Cancellation *cancel)
+{
+	return _finish(StreamOutput(&out, &handler), cancel);
+}
+
+bool Document::_feed(const StreamOutput& out, const std::string& text, const
+	Cancellation *cancel)
+{
+	if (mCancelled || mProcessed || mPasses!=0) return false;
+	if (mStream==0) {
+		if (mLineCount!=0) return false;
+		mStream=new StreamState;
+	}
+
+	// A line break can be two characters, and _getline takes a run of them
+	// as one or two breaks depending on what comes next, so only go as far
+	// as the last break that isn't at the end of the text so far.
+	std::string& t=mStream->text;
+	t+=text;
+	size_t lastText=t.find_last_not_of("\r\n");
+	if (lastText==std::string::npos) return true;
+	size_t lastBreak=t.find_last_of("\r\n", lastText);
+	if (lastBreak==std::string::npos) return true;
+
+	std::istringstream in(t.substr(0, lastBreak+1));
+	t.erase(0, lastBreak+1);
+	try {
+		_streamLines(out, in, false, cancel);
+	} catch (Cancelled&) {
+		mCancelled=true;
+		return false;
+	}
+	return true;
+}
+
+bool Document::_finish(const StreamOutput& out, const Cancellation *cancel) {
+	if (mCancelled || mProcessed || mPasses!=0) return false;
+	if (mStream==0) {
+		if (mLineCount!=0) return false;
+		mStream=new StreamState;
+	}
+
+	std::istringstream in(mStream->text);
+	mStream->text.clear();
+	try {
+		_streamLines(out, in, true, cancel);
+	} catch (Cancelled&) {
+		mCancelled=true;
+		return false;
+	}
+	mProcessed=true;
+	return true;
+}
+
+void Document::_streamLines(const StreamOutput& out, std::istream& in, bool
+	last, const Cancellation *cancel)
+{
+	StreamState& st=*mStream;
+	std::string line;
+	for (;;) {
+		TokenPtr t;
+		{
+			StageTimer timer(mTimings.read);
+			if (!_getline(in, line)) break;
+			checkCancelled(cancel);
+			if (isBlankLine(line)) t.reset(new token::BlankLine(line));
+			else t.reset(new token::RawText(line));
+			t->sourceRange(SourceRange(mLineCount, mLineCount+1));
+			++mLineCount;
+			mSourceBytes+=line.length()+1;
+		}
+
+		// The same places convert() splits its chunks at, but as early as
+		// possible, so each block goes out as soon as it's finished.
+		if (st.lines.size()>=st.minLines && isSafeLineSplit(st.lines.back(), t))
+			_streamChunk(out, false, cancel);
+		st.lines.push_back(t);
+	}
+	if (last) {
+		if (!st.lines.empty()) _streamChunk(out, true, cancel);
+		_writeStreamed(out, true, cancel);
+	}
+}
+
+void Document::_streamChunk(const StreamOutput& out, bool last, const
+	Cancellation *cancel)
+{
+	StreamState& st=*mStream;
+	TokenPtr chunk(new token::Container(st.lines));
+	PassState merge, inlineHtml;
+	size_t links=mIdTable->size();
+	{
+		StageTimer timer(mTimings.mergeHtmlTags);
+		_mergeMultilineHtmlTags(chunk, merge, cancel, 0);
+	}
+	{
+		StageTimer timer(mTimings.inlineHtmlAndReferences);
+		_processInlineHtmlAndReferences(chunk, inlineHtml, cancel, 0);
+	}
+
+	const TokenGroup& done=dynamic_cast<token::Container*>(chunk.get())->subTokens();
+	if (!last && (done.empty() || done.back()!=st.lines.back())) {
+		// As in _readStage: an inline HTML block may go on past the blank
+		// line at the end, so wait for more lines. The new link definitions
+		// will be found again then.
+		st.minLines=st.lines.size()*2;
+		return;
+	}
+	st.minLines=1;
+
+	if (!done.empty()) {
+		st.waiting.push_back(StreamState::Chunk(done, st.lines.size()));
+		st.waitingLines+=st.lines.size();
+	}
+	st.lines.clear();
+	if (!last && (st.waiting.size()>1 && mIdTable->size()==links)) {
+		// Nothing new for the held-back chunks to be retried with, so the
+		// new one waits its turn behind them.
+		if (mStreamPolicy.maxDeferredLines==0 ||
+			st.waitingLines<=mStreamPolicy.maxDeferredLines) return;
+	}
+	_writeStreamed(out, last, cancel);
+}
+
+void Document::_writeStreamed(const StreamOutput& out, bool all, const
+	Cancellation *cancel)
+{
+	StreamState& st=*mStream;
+	while (!st.waiting.empty()) {
+		StreamState::Chunk& c=st.waiting.front();
+		bool force=(all || mStreamPolicy.references==StreamPolicy::cResolveSoFar
+			|| (mStreamPolicy.maxDeferredLines!=0 &&
+			st.waitingLines>mStreamPolicy.maxDeferredLines));
+		if (!force) {
+			bool resolved=true;
+			for (size_t i=0; i<c.misses.size() && resolved; ++i)
+				if (!mIdTable->find(c.misses[i])) resolved=false;
+			if (!resolved) return;
+		}
+
+		TokenPtr chunk(new token::Container(c.tokens));
+		PassState blocks, paragraphs;
+		{
+			StageTimer timer(mTimings.blocks);
+			_processBlocksItems(chunk, blocks, cancel, 0);
+		}
+		{
+			StageTimer timer(mTimings.paragraphs);
+			_processParagraphLines(chunk, paragraphs, cancel, 0);
+		}
+
+		const TokenGroup& parsed=dynamic_cast<token::Container*>(chunk.get())->subTokens();
+		std::vector<TokenPtr> refined;
+		std::vector<std::string> misses;
+		{
+			StageTimer timer(mTimings.spans);
+			if (!force) mIdTable->recordMisses(&misses);
+			try {
+				for (CTokenGroupIter i=parsed.begin(), ie=parsed.end(); i!=ie; ++i)
+					refined.push_back(_refined(*i, cancel));
+			} catch (...) {
+				mIdTable->recordMisses(0);
+				throw;
+			}
+			mIdTable->recordMisses(0);
+		}
+		if (!misses.empty()) {
+			// Try again once they've all been defined.
+			c.misses.swap(misses);
+			return;
+		}
+
+		{
+			StageTimer timer(mTimings.write);
+			for (size_t i=0; i<refined.size(); ++i) {
+				checkCancelled(cancel);
+				if (out.html!=0) refined[i]->writeAsHtml(*out.html);
+				if (out.events!=0) refined[i]->writeAsEvents(*out.events,
+					refined[i]->sourceRange());
+			}
+		}
+		st.waitingLines-=c.lines;
+		st.waiting.pop_front();
+	}
 }
 
 void Document::writeTokens(std::ostream& out) {
-	_process();
+	if (_process()) _processSpans(0, mBlocks.size(), 0);
+
+	// Span processing can replace top-level blocks, so put the current ones
+	// back into the container before dumping it.
+	TokenGroup blocks(mBlocks.begin(), mBlocks.end());
+	token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
+	assert(tokens!=0);
+	tokens->swapSubtokens(blocks);
+
 	mTokenContainer->writeToken(0, out);
 }
 
-void Document::_process() {
-	if (!mProcessed) {
-		_mergeMultilineHtmlTags();
-		_processInlineHtmlAndReferences();
-		_processBlocksItems(mTokenContainer);
-		_processParagraphLines(mTokenContainer);
-		mTokenContainer->processSpanElements(*mIdTable);
-		mProcessed=true;
+bool Document::writeBinary(std::ostream& out, const Cancellation *cancel) {
+	if (!_process(cancel)) return false;
+	if (!_processSpans(0, mBlocks.size(), cancel)) return false;
+	StageTimer timer(mTimings.write);
+	binary::Writer writer;
+	for (size_t b=0; b<mBlocks.size(); ++b) {
+		if (cancel!=0 && cancel->cancelled()) return false;
+		writer.add(*mBlocks[b]);
 	}
+	return writer.write(out, mLineCount);
+}
+
+size_t Document::blockCount() {
+	_process();
+	return mBlocks.size();
 }
 
-void Document::_mergeMultilineHtmlTags() {
-	static const boost::regex cHtmlTokenStart("<((/?)([a-zA-Z0-9]+)(?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\5))*? */? *))$");
-	static const boost::regex cHtmlTokenEnd("^ *((?:( +[a-zA-Z0-9]+?(?: ?= ?(\"|').*?\\3))*? */? *))>");
+const SourceIndex& Document::sourceIndex() {
+	_process();
+	return mSourceIndex;
+}
 
-	TokenGroup processed;
+bool Document::step(Cancellation::Clock::time_point deadline, const
+	Cancellation *cancel)
+{
+	_runPasses(cancel, &deadline);
+	return (mProcessed || mCancelled);
+}
+
+bool Document::_process(const Cancellation *cancel) {
+	_runPasses(cancel, 0);
+	return !mCancelled;
+}
+
+void Document::_runPasses(const Cancellation *cancel, Deadline deadline) {
+	if (mProcessed || mCancelled) return;
+
+	if (mOverBudget==cWithinBudget) {
+		if (mPasses==0) mPasses=new PassState;
+
+		// With a time budget, the passes watch a deadline as well as `cancel`:
+		// whatever is left of the budget after any earlier steps.
+		unsigned long long spentMs=(mTimings.mergeHtmlTags+
+			mTimings.inlineHtmlAndReferences+mTimings.blocks+
+			mTimings.paragraphs)/1000;
+		Cancellation timeLimit(cancel, Cancellation::Clock::now()+
+			boost::chrono::milliseconds(spentMs<mBudget.maxProcessingMs ?
+			mBudget.maxProcessingMs-spentMs : 0));
+		const Cancellation *passCancel=(mBudget.maxProcessingMs!=0 ?
+			&timeLimit : cancel);
+
+		try {
+			while (mPasses->pass<4) {
+				checkCancelled(passCancel);
+				bool finished=false;
+				// Chunked parsing does the block and paragraph passes in one go.
+				if (mPasses->pass==2 && !mPasses->started && deadline==0) {
+					StageTimer timer(mTimings.blocks);
+					if (_processBlocksInChunks(passCancel)) {
+						mPasses->nextPass();
+						mPasses->nextPass();
+						continue;
+					}
+				}
+
+				switch (mPasses->pass) {
+					case 0: {
+						StageTimer timer(mTimings.mergeHtmlTags);
+						finished=_mergeMultilineHtmlTags(mTokenContainer,
+							*mPasses, passCancel, deadline);
+					} break;
+					case 1: {
+						StageTimer timer(mTimings.inlineHtmlAndReferences);
+						finished=_processInlineHtmlAndReferences(
+							mTokenContainer, *mPasses, passCancel, deadline);
+					} break;
+					case 2: {
+						StageTimer timer(mTimings.blocks);
+						finished=_processBlocksItems(mTokenContainer, *mPasses,
+							passCancel, deadline);
+					} break;
+					case 3: {
+						StageTimer timer(mTimings.paragraphs);
+						finished=_processParagraphLines(mTokenContainer,
+							*mPasses, passCancel, deadline);
+					} break;
+				}
+				if (!finished) return;
+				mPasses->nextPass();
+			}
+			checkCancelled(passCancel);
+		} catch (Cancelled&) {
+			delete mPasses;
+			mPasses=0;
+			if (passCancel==cancel || (cancel!=0 && cancel->cancelled())) {
+				// The passes rebuild the token list as they go, so there's
+				// no picking up where this one left off.
+				mCancelled=true;
+				return;
+			}
+			mOverBudget=cOverTimeBudget;
+		}
+		delete mPasses;
+		mPasses=0;
+	}
+
+	if (mOverBudget!=cWithinBudget) {
+		_buildFallback();
+	} else {
+		// Span elements are handled per block, when the block is written.
+		token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
+		assert(tokens!=0);
+		mBlocks.assign(tokens->subTokens().begin(), tokens->subTokens().end());
+		mSpansProcessed.assign(mBlocks.size(), false);
+		mSourceIndex.build(tokens->subTokens());
+		std::string().swap(mFallbackSource);
+		std::vector<Heading>().swap(mFallbackHeadings);
+	}
+	mProcessed=true;
+}
+
+bool Document::outline(const std::string& source, std::vector<Heading>&
+	headings, const Cancellation *cancel, size_t spacesPerTab)
+{
+	headings.clear();
+	Document scratch(spacesPerTab);
+	try {
+		// The lines are split the way _getline does it, and only expanded
+		// and turned into tokens when they have to be looked at closely.
+		const char *p=source.data(), *end=p+source.size();
+		const char *chunkStart=p, *chunkSecondEnd=p;
+		size_t line=0, chunkLine=0, minLines=1, candidates=0, candidateLine=0;
+		bool previousBlank=false, mayHaveHtml=false, underline=false;
+		std::string expanded;
+		for (;;) {
+			if ((line & 0x3ff)==0) checkCancelled(cancel);
+			const char *lineStart=p;
+			while (p<end && *p!='\n' && *p!='\r') ++p;
+			const char *lineEnd=p;
+			if (p<end) {
+				char c=*p++;
+				if (p<end && *p==(c=='\r' ? '\n' : '\r')) ++p;
+			}
+			bool atEnd=(lineStart==end);
+
+			const char *first=lineStart;
+			while (first<lineEnd && (*first==' ' || *first=='\t')) ++first;
+			bool blank=(first==lineEnd);
+			if (!blank && *first=='<') {
+				// Could be a comment that counts as a blank line.
+				std::istringstream in(std::string(lineStart, lineEnd));
+				scratch._getline(in, expanded);
+				blank=isBlankLine(expanded);
+			}
+
+			bool split=atEnd;
+			if (!atEnd && previousBlank && !blank && line-chunkLine>=minLines) {
+				// Lines that can't start a list or be a link definition are
+				// safe to split before without a closer look.
+				char c=*lineStart;
+				split=true;
+				if (c==' ' || c=='\t' || c=='>' || c=='<') split=false;
+				else if (c=='*' || c=='+' || c=='-' || c=='[' || (c>='0' && c<='9')) {
+					std::istringstream in(std::string(lineStart, lineEnd));
+					scratch._getline(in, expanded);
+					split=isSafeLineSplit(TokenPtr(new token::BlankLine),
+						TokenPtr(new token::RawText(expanded)));
+				}
+			}
+
+			if (split && (candidates!=0 || mayHaveHtml)) {
+				std::string text(chunkStart, lineStart);
+				// Most chunks with a header in them start with it. A chunk
+				// (other than the first) starts at the top level, with a line
+				// nothing before could take, so whether that line is a header
+				// only depends on the line after it.
+				bool quick=(chunkLine!=0 && candidates==1 &&
+					(candidateLine==chunkLine || (candidateLine==chunkLine+1 &&
+					underline)));
+				if (mayHaveHtml && !scratch._outlineChunk(text, chunkLine, atEnd,
+					candidates!=0 && !quick, headings, cancel))
+				{
+					// An inline HTML block may go on past the blank line; as
+					// in _readStage, try again with twice as many lines.
+					minLines=(line-chunkLine)*2;
+					split=false;
+				} else if (quick) {
+					std::istringstream in(std::string(chunkStart, chunkSecondEnd));
+					TokenGroup lines;
+					while (scratch._getline(in, expanded)) {
+						if (isBlankLine(expanded)) lines.push_back(TokenPtr(new token::BlankLine(expanded)));
+						else lines.push_back(TokenPtr(new token::RawText(expanded)));
+					}
+					CTokenGroupIter i=lines.begin();
+					optional<TokenPtr> h=parseHeader(i, lines.end());
+					if (h) {
+						const token::Header *header=dynamic_cast<const token::Header*>(h->get());
+						headings.push_back(Heading(chunkLine, header->level(),
+							*header->text()));
+					}
+				} else if (!mayHaveHtml) {
+					scratch._outlineChunk(text, chunkLine, atEnd, true, headings,
+						cancel);
+				}
+			}
+			if (atEnd) break;
+			if (split) {
+				chunkStart=lineStart;
+				chunkLine=line;
+				minLines=1;
+				candidates=0;
+				mayHaveHtml=false;
+			}
+			if (line<=chunkLine+1) chunkSecondEnd=p;
+
+			if (!blank) {
+				char c=*lineStart;
+				bool candidate=(c=='#'), isUnderline=false;
+				if (c=='=' || c=='-') {
+					const char *i=lineStart;
+					while (i<lineEnd && *i==c) ++i;
+					candidate=isUnderline=(i==lineEnd);
+				}
+				if (candidate && candidates++==0) {
+					candidateLine=line;
+					underline=isUnderline;
+				}
+				if (*first=='<') mayHaveHtml=true;
+			}
+			previousBlank=blank;
+			++line;
+		}
+	} catch (Cancelled&) {
+		headings.clear();
+		return false;
+	}
+	return true;
+}
+
+bool Document::_outlineChunk(const std::string& text, size_t firstLine, bool
+	last, bool findHeaders, std::vector<Heading>& headings, const Cancellation
+	*cancel)
+{
+	std::istringstream in(text);
+	std::string line;
+	TokenGroup lines;
+	size_t lineNumber=firstLine;
+	while (_getline(in, line)) {
+		if (isBlankLine(line)) lines.push_back(TokenPtr(new token::BlankLine(line)));
+		else lines.push_back(TokenPtr(new token::RawText(line)));
+		lines.back()->sourceRange(SourceRange(lineNumber, lineNumber+1));
+		++lineNumber;
+	}
+
+	TokenPtr chunk(new token::Container(lines));
+	PassState merge, inlineHtml, blocks;
+	_mergeMultilineHtmlTags(chunk, merge, cancel, 0);
+	_processInlineHtmlAndReferences(chunk, inlineHtml, cancel, 0);
+	const TokenGroup& done=dynamic_cast<token::Container*>(chunk.get())->subTokens();
+	if (!last && (done.empty() || done.back()!=lines.back())) return false;
+	if (!findHeaders) return true;
+
+	_processBlocksItems(chunk, blocks, cancel, 0);
+	for (CTokenGroupIter i=done.begin(), ie=done.end(); i!=ie; ++i) {
+		const token::Header *h=dynamic_cast<const token::Header*>(i->get());
+		if (h!=0) headings.push_back(Heading(h->sourceRange().first, h->level(),
+			*h->text()));
+	}
+	return true;
+}
+
+void Document::_keepForFallback(const std::string& line, const std::string&
+	previousLine, size_t lineNumber)
+{
+	if (mBudget.fallback==Budget::cHeadingsOnly) {
+		size_t level;
+		std::string text;
+		bool underlined;
+		if (scanHeading(line, previousLine, level, text, underlined))
+			mFallbackHeadings.push_back(Heading(underlined ? lineNumber-1 :
+				lineNumber, level, text));
+	} else if (mBudget.maxSourceBytes==0 ||
+		mFallbackSource.length()<mBudget.maxSourceBytes)
+	{
+		mFallbackSource+=line;
+		mFallbackSource+='\n';
+	}
+}
+
+void Document::_buildFallback() {
+	// Whatever the passes got through is of no further use.
+	mTokenContainer.reset(new token::Container);
+
+	TokenGroup blocks;
+	if (mBudget.fallback==Budget::cHeadingsOnly) {
+		for (std::vector<Heading>::const_iterator i=mFallbackHeadings.begin(),
+			ie=mFallbackHeadings.end(); i!=ie; ++i)
+		{
+			blocks.push_back(TokenPtr(new token::Header(i->level, i->text)));
+			blocks.back()->sourceRange(SourceRange(i->line, i->line+1));
+		}
+	} else {
+		blocks.push_back(TokenPtr(new token::CodeBlock(mFallbackSource)));
+		blocks.back()->sourceRange(SourceRange(0, mLineCount));
+	}
+	std::string().swap(mFallbackSource);
+	std::vector<Heading>().swap(mFallbackHeadings);
+
+	mBlocks.assign(blocks.begin(), blocks.end());
+	mSpansProcessed.assign(mBlocks.size(), false);
+	mSourceIndex.build(blocks);
+}
+
+bool Document::_processBlocksInChunks(const Cancellation *cancel) {
+	if (mPool==0 || mPool->threads()<2) return false;
 
 	token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
 	assert(tokens!=0);
+	const TokenGroup& all=tokens->subTokens();
+	if (all.size()<cMinChunkTokens*2) return false;
+
+	// A few chunks per thread, so the work stealing can even them out.
+	size_t chunkTokens=std::max(cMinChunkTokens, all.size()/(mPool->threads()*4));
+
+	std::vector<TokenGroup> groups(1);
+	size_t inGroup=0;
+	for (CTokenGroupIter i=all.begin(), ie=all.end(); i!=ie; ++i, ++inGroup) {
+		checkCancelled(cancel);
+		if (inGroup>=chunkTokens && i!=all.begin()) {
+			CTokenGroupIter previous=i;
+			--previous;
+			if (isSafeBlockSplit(*previous, *i)) {
+				groups.push_back(TokenGroup());
+				inGroup=0;
+			}
+		}
+		groups.back().push_back(*i);
+	}
+	if (groups.size()<2) return false;
+
+	std::vector<TokenPtr> chunks;
+	chunks.reserve(groups.size());
+	for (size_t c=0; c<groups.size(); ++c)
+		chunks.push_back(TokenPtr(new token::Container(groups[c])));
+	std::vector<TokenGroup>().swap(groups);
+
+	JobState state;
+	mPool->run(chunks.size(), boost::bind(&Document::_chunkJob, this, &chunks,
+		cancel, &state, _1));
+	if (state.wasCancelled()) throw Cancelled();
+
+	TokenGroup processed;
+	for (size_t c=0; c<chunks.size(); ++c) {
+		token::Container *chunk=dynamic_cast<token::Container*>(chunks[c].get());
+		assert(chunk!=0);
+		processed.insert(processed.end(), chunk->subTokens().begin(),
+			chunk->subTokens().end());
+	}
+	tokens->swapSubtokens(processed);
+	return true;
+}
+
+void Document::_chunkJob(const std::vector<TokenPtr> *chunks, const
+	Cancellation *cancel, JobState *state, size_t job)
+{
+	if (state->stopping()) return;
+	try {
+		PassState blocks, paragraphs;
+		_processBlocksItems((*chunks)[job], blocks, cancel, 0);
+		_processParagraphLines((*chunks)[job], paragraphs, cancel, 0);
+	} catch (Cancelled&) {
+		state->halt(false);
+	} catch (...) {
+		state->halt(true);
+	}
+}
+
+bool Document::_processSpans(size_t firstBlock, size_t lastBlock, const
+	Cancellation *cancel)
+{
+	if (mCancelled) return false;
+
+	StageTimer timer(mTimings.spans);
+	if (mPool!=0 && mPool->threads()>1) {
+		// Blocks don't share anything but the (by now read-only) link table,
+		// and each job only replaces its own entry in mBlocks, so the result
+		// doesn't depend on which thread gets which block.
+		std::vector<size_t> blocks;
+		for (size_t b=firstBlock; b<lastBlock; ++b)
+			if (!mSpansProcessed[b]) blocks.push_back(b);
+		JobState state;
+		mPool->run(blocks.size(), boost::bind(&Document::_spanJob, this,
+			&blocks, cancel, &state, _1));
+		// Some of the blocks may have been replaced, and part of one, so the
+		// document can't be written after either.
+		if (state.error) mCancelled=true;
+		if (state.wasCancelled()) {
+			mCancelled=true;
+			return false;
+		}
+		for (size_t i=0; i<blocks.size(); ++i) mSpansProcessed[blocks[i]]=true;
+		return true;
+	}
+
+	for (size_t b=firstBlock; b<lastBlock; ++b) {
+		if (mSpansProcessed[b]) continue;
+		if (!_processBlockSpans(b, cancel)) {
+			mCancelled=true;
+			return false;
+		}
+		mSpansProcessed[b]=true;
+	}
+	return true;
+}
+
+void Document::_spanJob(const std::vector<size_t> *blocks, const Cancellation
+	*cancel, JobState *state, size_t job)
+{
+	if (state->stopping()) return;
+	try {
+		if (!_processBlockSpans((*blocks)[job], cancel)) state->halt(false);
+	} catch (...) {
+		state->halt(true);
+	}
+}
+
+bool Document::_processBlockSpans(size_t b, const Cancellation *cancel) {
+	try {
+		mBlocks[b]=_refined(mBlocks[b], cancel);
+	} catch (Cancelled&) {
+		// Part of the block may already have been replaced.
+		return false;
+	}
+	return true;
+}
+
+TokenPtr Document::_refined(TokenPtr block, const Cancellation *cancel) const {
+	// The same work token::Container::processSpanElements does for each of its
+	// subtokens.
+	optional<TokenGroup> subt=block->processSpanElements(*mIdTable, cancel);
+	if (!subt) return block;
+
+	TokenPtr r;
+	if (block->text()) {
+		if (subt->size()>1) r=TokenPtr(new token::Container(*subt));
+		else if (!subt->empty()) r=*subt->begin();
+		else r=TokenPtr(new token::Container);
+	} else {
+		const token::Container *c=dynamic_cast<const token::Container*>(block.get());
+		assert(c!=0);
+		r=c->clone(*subt);
+	}
+	r->sourceRange(block->sourceRange());
+	return r;
+}
+
+bool Document::_writeBlocks(std::ostream *out, EventHandler *events, size_t
+	firstBlock, size_t lastBlock, const Cancellation *cancel)
+{
+	StageTimer timer(mTimings.write);
+	if (events!=0 || mPool==0 || mPool->threads()<2 || lastBlock<firstBlock+2) {
+		// Events have to come in order, on the caller's thread.
+		for (size_t b=firstBlock; b<lastBlock; ++b) {
+			if (cancel!=0 && cancel->cancelled()) return false;
+			if (out!=0) mBlocks[b]->writeAsHtml(*out);
+			if (events!=0) mBlocks[b]->writeAsEvents(*events,
+				mBlocks[b]->sourceRange());
+		}
+		return true;
+	}
+
+	// Finished blocks write their HTML without looking at anything outside
+	// themselves, so runs of them can go into buffers of their own on any
+	// thread. (A buffer per block costs more in stream setup than small
+	// blocks take to write.) A running total of the buffer sizes gives each
+	// one's place in the output, which is then put together in a single
+	// allocation, in parallel too since it's just copying, and written in
+	// one go.
+	const size_t count=lastBlock-firstBlock;
+	const size_t runs=std::min(count, mPool->threads()*cWriteRunsPerThread);
+	std::vector<std::string> html(runs);
+	JobState state;
+	mPool->run(runs, boost::bind(&Document::_htmlJob, this, firstBlock,
+		lastBlock, &html, cancel, &state, _1));
+	if (state.wasCancelled()) return false;
+
+	std::vector<size_t> offsets(runs);
+	size_t total=0;
+	for (size_t i=0; i<runs; ++i) {
+		offsets[i]=total;
+		total+=html[i].size();
+	}
+	if (total==0) return true;
+
+	std::string all(total, '\0');
+	JobState copying;
+	mPool->run(runs, boost::bind(&Document::_copyHtmlJob, &html, &offsets, &all[0],
+		&copying, _1));
+	copying.wasCancelled();
+	out->write(all.data(), all.size());
+	return true;
+}
+
+void Document::_htmlJob(size_t firstBlock, size_t lastBlock, std::vector<
+	std::string> *html, const Cancellation *cancel, JobState *state, size_t
+	job)
+{
+	const size_t count=lastBlock-firstBlock, runs=html->size();
+	const size_t first=firstBlock+count*job/runs,
+		last=firstBlock+count*(job+1)/runs;
+	try {
+		std::ostringstream buffer;
+		for (size_t b=first; b<last; ++b) {
+			if (state->stopping()) return;
+			if (cancel!=0 && cancel->cancelled()) {
+				state->halt(false);
+				return;
+			}
+			mBlocks[b]->writeAsHtml(buffer);
+		}
+		(*html)[job]=buffer.str();
+	} catch (...) {
+		state->halt(true);
+	}
+}
+
+bool Document::_mergeMultilineHtmlTags(TokenPtr inTokenContainer, PassState&
+	state, const Cancellation *cancel, Deadline deadline)
+{
+	token::Container *tokens=dynamic_cast<token::Container*>(inTokenContainer.get());
+	assert(tokens!=0);
+
+	if (!state.started) { state.at=tokens->subTokens().begin(); state.started=true; }
+	TokenGroup& processed=state.processed;
 
-	for (TokenGroup::const_iterator i=tokens->subTokens().begin(),
-		ie=tokens->subTokens().end(); i!=ie; ++i)
+	for (TokenGroup::const_iterator i=state.at, ie=tokens->subTokens().end();
+		i!=ie; ++i)
 	{
-		if ((*i)->text() && boost::regex_match(*(*i)->text(), cHtmlTokenStart)) {
+		checkCancelled(cancel);
+		if (i!=state.at && pastDeadline(deadline)) { state.at=i; return false; }
+		if ((*i)->text() && boost::regex_match(*(*i)->text(), cHtmlTokenStartExpression.get())) {
 			TokenGroup::const_iterator i2=i;
 			++i2;
 			if (i2!=tokens->subTokens().end() && (*i2)->text() &&
-				boost::regex_match(*(*i2)->text(), cHtmlTokenEnd))
+				boost::regex_match(*(*i2)->text(), cHtmlTokenEndExpression.get()))
 			{
 				processed.push_back(TokenPtr(new markdown::token::RawText(*(*i)->text()+' '+*(*i2)->text())));
+				processed.back()->sourceRange(sourceLines(i, i2, tokens->subTokens().end()));
 				++i;
 				continue;
 			}
@@ -720,21 +2184,29 @@ void Document::_mergeMultilineHtmlTags() {
 		processed.push_back(*i);
 	}
 	tokens->swapSubtokens(processed);
+	return true;
 }
 
-void Document::_processInlineHtmlAndReferences() {
-	TokenGroup processed;
-
-	token::Container *tokens=dynamic_cast<token::Container*>(mTokenContainer.get());
+bool Document::_processInlineHtmlAndReferences(TokenPtr inTokenContainer,
+	PassState& state, const Cancellation *cancel, Deadline deadline)
+{
+	token::Container *tokens=dynamic_cast<token::Container*>(inTokenContainer.get());
 	assert(tokens!=0);
 
-	for (TokenGroup::const_iterator ii=tokens->subTokens().begin(),
-		iie=tokens->subTokens().end(); ii!=iie; ++ii)
+	if (!state.started) { state.at=tokens->subTokens().begin(); state.started=true; }
+	TokenGroup& processed=state.processed;
+
+	for (TokenGroup::const_iterator ii=state.at, iie=tokens->subTokens().end();
+		ii!=iie; ++ii)
 	{
+		checkCancelled(cancel);
+		if (ii!=state.at && pastDeadline(deadline)) { state.at=ii; return false; }
 		if ((*ii)->text()) {
 			if (processed.empty() || processed.back()->isBlankLine()) {
+				CTokenGroupIter first=ii;
 				optional<TokenPtr> inlineHtml=parseInlineHtml(ii, iie);
 				if (inlineHtml) {
+					(*inlineHtml)->sourceRange(sourceLines(first, ii, iie));
 					processed.push_back(*inlineHtml);
 					if (ii==iie) break;
 					continue;
@@ -754,20 +2226,27 @@ void Document::_processInlineHtmlAndReferences() {
 		processed.push_back(*ii);
 	}
 	tokens->swapSubtokens(processed);
+	return true;
 }
 
-void Document::_processBlocksItems(TokenPtr inTokenContainer) {
-	if (!inTokenContainer->isContainer()) return;
+bool Document::_processBlocksItems(TokenPtr inTokenContainer, PassState&
+	state, const Cancellation *cancel, Deadline deadline)
+{
+	if (!inTokenContainer->isContainer()) return true;
 
 	token::Container *tokens=dynamic_cast<token::Container*>(inTokenContainer.get());
 	assert(tokens!=0);
 
-	TokenGroup processed;
+	if (!state.started) { state.at=tokens->subTokens().begin(); state.started=true; }
+	TokenGroup& processed=state.processed;
 
-	for (TokenGroup::const_iterator ii=tokens->subTokens().begin(),
-		iie=tokens->subTokens().end(); ii!=iie; ++ii)
+	for (TokenGroup::const_iterator ii=state.at, iie=tokens->subTokens().end();
+		ii!=iie; ++ii)
 	{
+		checkCancelled(cancel);
+		if (ii!=state.at && pastDeadline(deadline)) { state.at=ii; return false; }
 		if ((*ii)->text()) {
+			CTokenGroupIter first=ii;
 			optional<TokenPtr> subitem;
 			if (!subitem) subitem=parseHeader(ii, iie);
 			if (!subitem) subitem=parseHorizontalRule(ii, iie);
@@ -776,54 +2255,74 @@ void Document::_processBlocksItems(TokenPtr inTokenContainer) {
 			if (!subitem) subitem=parseCodeBlock(ii, iie);
 
 			if (subitem) {
-				_processBlocksItems(*subitem);
+				// Containers already know their lines from their contents.
+				if ((*subitem)->sourceRange().empty())
+					(*subitem)->sourceRange(sourceLines(first, ii, iie));
+				// Nested blocks are done in one go, as part of their parent.
+				PassState nested;
+				_processBlocksItems(*subitem, nested, cancel, 0);
 				processed.push_back(*subitem);
 				if (ii==iie) break;
 				continue;
 			} else processed.push_back(*ii);
 		} else if ((*ii)->isContainer()) {
-			_processBlocksItems(*ii);
+			PassState nested;
+			_processBlocksItems(*ii, nested, cancel, 0);
 			processed.push_back(*ii);
 		}
 	}
 	tokens->swapSubtokens(processed);
+	return true;
 }
 
-void Document::_processParagraphLines(TokenPtr inTokenContainer) {
+bool Document::_processParagraphLines(TokenPtr inTokenContainer, PassState&
+	state, const Cancellation *cancel, Deadline deadline)
+{
 	token::Container *tokens=dynamic_cast<token::Container*>(inTokenContainer.get());
 	assert(tokens!=0);
 
-	bool noPara=tokens->inhibitParagraphs();
-	for (TokenGroup::const_iterator ii=tokens->subTokens().begin(),
-		iie=tokens->subTokens().end(); ii!=iie; ++ii)
-			if ((*ii)->isContainer()) _processParagraphLines(*ii);
+	if (!state.started) { state.at=tokens->subTokens().begin(); state.started=true; }
+	TokenGroup& processed=state.processed;
+	std::string& paragraphText=state.paragraphText;
+	SourceRange& paragraphLines=state.paragraphLines;
+	TokenGroup& paragraphTokens=state.paragraphTokens;
 
-	TokenGroup processed;
-	std::string paragraphText;
-	TokenGroup paragraphTokens;
-	for (TokenGroup::const_iterator ii=tokens->subTokens().begin(),
-		iie=tokens->subTokens().end(); ii!=iie; ++ii)
+	bool noPara=tokens->inhibitParagraphs();
+	for (TokenGroup::const_iterator ii=state.at, iie=tokens->subTokens().end();
+		ii!=iie; ++ii)
 	{
+		checkCancelled(cancel);
+		if (ii!=state.at && pastDeadline(deadline)) { state.at=ii; return false; }
+
+		// A container's own contents don't affect this level's paragraphs,
+		// so it can be done here rather than in a separate pass beforehand.
+		if ((*ii)->isContainer()) {
+			PassState nested;
+			_processParagraphLines(*ii, nested, cancel, 0);
+		}
+
 		if ((*ii)->text() && (*ii)->canContainMarkup() && !(*ii)->inhibitParagraphs()) {
-			static const boost::regex cExpression("^(.*)  $");
 			if (!paragraphText.empty()) paragraphText+=" ";
 
+			paragraphLines.merge((*ii)->sourceRange());
+
 			boost::smatch m;
-			if (boost::regex_match(*(*ii)->text(), m, cExpression)) {
+			if (boost::regex_match(*(*ii)->text(), m, cLineBreakExpression.get())) {
 				paragraphText += m[1];
-				flushParagraph(paragraphText, paragraphTokens, processed, noPara);
-				processed.push_back(TokenPtr(new markdown::token::HtmlTag("br/")));
+				flushParagraph(paragraphText, paragraphLines, paragraphTokens, processed, noPara);
+				processed.push_back(fromLine(new markdown::token::HtmlTag("br/"), ii));
 			} else paragraphText += *(*ii)->text();
 		} else {
-			flushParagraph(paragraphText, paragraphTokens, processed, noPara);
+			flushParagraph(paragraphText, paragraphLines, paragraphTokens, processed, noPara);
 			processed.push_back(*ii);
 		}
 	}
 
 	// Make sure the last paragraph is properly flushed too.
-	flushParagraph(paragraphText, paragraphTokens, processed, noPara);
+	flushParagraph(paragraphText, paragraphLines, paragraphTokens, processed, noPara);
 
 	tokens->swapSubtokens(processed);
+	return true;
 }
 
 } // namespace markdown
@@ -11,11 +11,14 @@
 #include <iostream>
 #include <string>
 #include <list>
+#include <vector>
 
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/optional.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
 
 namespace markdown {
 
@@ -25,23 +28,343 @@ namespace markdown {
 	// Forward references.
 	class Token;
 	class LinkIds;
+	class WorkPool;
 
 	typedef boost::shared_ptr<Token> TokenPtr;
 	typedef std::list<TokenPtr> TokenGroup;
 
+	// A range of source lines, zero-based, from `first` up to but not
+	// including `last`. Tokens that weren't built from source lines (the ones
+	// created during span processing, for instance) have an empty range.
+	struct SourceRange {
+		size_t first, last;
+
+		SourceRange(): first(0), last(0) { }
+		SourceRange(size_t first_, size_t last_): first(first_), last(last_) { }
+
+		bool empty() const { return (first>=last); }
+		bool contains(size_t line) const { return (line>=first && line<last); }
+		void merge(const SourceRange& r) {
+			if (r.empty()) return;
+			if (empty()) { *this=r; return; }
+			if (r.first<first) first=r.first;
+			if (r.last>last) last=r.last;
+		}
+	};
+
+	// Maps source lines to the top-level blocks of a processed document, and
+	// back. Blocks are numbered in output order.
+	class SourceIndex {
+		public:
+		void build(const TokenGroup& blocks);
+		void clear();
+
+		size_t blocks() const { return mRanges.size(); }
+
+		// The block containing the line. If the line didn't produce a block of
+		// its own (a blank line or a link definition), it's the nearest block
+		// before it.
+		optional<size_t> blockAtLine(size_t line) const;
+		SourceRange linesOfBlock(size_t block) const;
+
+		private:
+		typedef std::pair<size_t, size_t> LineEntry; // First line, block
+
+		std::vector<SourceRange> mRanges;
+		std::vector<LineEntry> mByLine;
+	};
+
+	// Lets another thread stop a read() or write() that's in progress. The
+	// engine checks it between its processing passes and inside their loops,
+	// so a superseded job stops within about one line or block of work.
+	class Cancellation: private boost::noncopyable {
+		public:
+		typedef boost::chrono::steady_clock Clock;
+
+		Cancellation(): mCancelled(false), mParent(0), mHasDeadline(false) { }
+		// Also counts as cancelled once `parent` is (if there is one), or once
+		// the clock reaches `deadline`.
+		Cancellation(const Cancellation *parent, Clock::time_point deadline):
+			mCancelled(false), mParent(parent), mHasDeadline(true),
+			mDeadline(deadline) { }
+
+		void cancel() { mCancelled.store(true, boost::memory_order_relaxed); }
+		bool cancelled() const {
+			if (mCancelled.load(boost::memory_order_relaxed)) return true;
+			if (mParent!=0 && mParent->cancelled()) return true;
+			return (mHasDeadline && Clock::now()>=mDeadline);
+		}
+
+		private:
+		boost::atomic<bool> mCancelled;
+		const Cancellation *mParent;
+		bool mHasDeadline;
+		Clock::time_point mDeadline;
+	};
+
+	// Limits on what a document may cost to process, and what to show
+	// instead of it when they're exceeded. Zero means no limit.
+	//
+	// The token tree takes many times the size of the source, so the memory
+	// limit is on the source: past `maxSourceBytes`, read() stops building
+	// tokens. The time limit covers the block passes, the part that has to
+	// finish before anything can be written. With either limit set, the
+	// document keeps up to `maxSourceBytes` of the source (all of it if
+	// there's no memory limit) and the headings aside for the fallback.
+	struct Budget {
+		enum Fallback {
+			cPlainText,   // The source, escaped, in a <pre> block
+			cHeadingsOnly // Just the headings
+		};
+
+		size_t maxSourceBytes;
+		unsigned long maxProcessingMs;
+		Fallback fallback;
+
+		Budget(): maxSourceBytes(0), maxProcessingMs(0), fallback(cPlainText) { }
+
+		bool limited() const { return (maxSourceBytes!=0 || maxProcessingMs!=0); }
+	};
+
+	enum OverBudget { cWithinBudget, cOverMemoryBudget, cOverTimeBudget };
+
+	// What a streamed document (see Document::feed) does with a block that
+	// links to a reference it hasn't seen the definition of, since the
+	// definition may still be on its way.
+	struct StreamPolicy {
+		enum References {
+			cDeferUnresolved, // Hold the block (and everything after it) back
+			                  // until the references are defined, or the
+			                  // input ends
+			cResolveSoFar     // Write it right away, leaving the references
+			                  // it can't resolve as they stand
+		};
+
+		References references;
+		// With cDeferUnresolved, past this many held-back source lines the
+		// oldest held-back block is written as it would be with
+		// cResolveSoFar, so a bracketed phrase that never gets a definition
+		// (a "[sic]", say) only holds up the output for so long. The output
+		// is the same as from read() and write() unless a definition comes
+		// further down than that. Zero means no limit, which always gives
+		// the same output, but keeps everything after such a phrase in
+		// memory until the end.
+		size_t maxDeferredLines;
+
+		static const size_t cDefaultMaxDeferredLines;
+
+		StreamPolicy(): references(cDeferUnresolved),
+			maxDeferredLines(cDefaultMaxDeferredLines) { }
+	};
+
+	// Time spent in each processing stage, in microseconds. Span processing
+	// and writing are added up over all the write() calls.
+	struct Timings {
+		unsigned long long read, mergeHtmlTags, inlineHtmlAndReferences,
+			blocks, paragraphs, spans, write;
+
+		Timings(): read(0), mergeHtmlTags(0), inlineHtmlAndReferences(0),
+			blocks(0), paragraphs(0), spans(0), write(0) { }
+	};
+
+	// A header, with its (zero-based) source line.
+	struct Heading {
+		size_t line, level;
+		std::string text;
+
+		Heading(size_t line_, size_t level_, const std::string& text_):
+			line(line_), level(level_), text(text_) { }
+	};
+
+	// Receives a document's contents as a series of calls instead of HTML:
+	// an enter and an exit around each block and span that holds others, and
+	// a call for each piece of text, code, raw HTML or image, in document
+	// order. The source lines are those of the innermost block the event is
+	// in, since spans don't keep lines of their own. Header text is given as
+	// it stands, since the engine doesn't do span processing on headers.
+	// Override the ones you need; the rest do nothing.
+	class EventHandler {
+		public:
+		enum Block { cParagraph, cHeader, cBlockQuote, cUnorderedList,
+			cOrderedList, cListItem, cHtmlBlock };
+		enum Span { cEmphasis, cStrong, cLink };
+
+		virtual ~EventHandler() { }
+
+		// `level` is a header's level, and zero for other blocks.
+		virtual void enterBlock(Block type, size_t level, const SourceRange&
+			lines) { }
+		virtual void exitBlock(Block type, const SourceRange& lines) { }
+		// `url` and `title` are a link's, and empty for other spans.
+		virtual void enterSpan(Span type, const std::string& url, const
+			std::string& title, const SourceRange& lines) { }
+		virtual void exitSpan(Span type, const SourceRange& lines) { }
+		virtual void text(const std::string& text, const SourceRange& lines) { }
+		// `block` is true for a code block, false for a code span.
+		virtual void code(const std::string& text, bool block, const
+			SourceRange& lines) { }
+		virtual void html(const std::string& html, const SourceRange& lines) { }
+		virtual void image(const std::string& altText, const std::string& url,
+			const std::string& title, const SourceRange& lines) { }
+	};
+
+	// Compiles the engine's regular expressions and builds its tables, which
+	// otherwise happens piecemeal during the first read() and write(). It's
+	// safe to call from a background thread while documents are processed on
+	// another, and cheap to call again.
+	void warmUp();
+
 	class Document: private boost::noncopyable {
 		public:
+		static const size_t cDefaultSpacesPerTab;
+
 		Document(size_t spacesPerTab=cDefaultSpacesPerTab);
 		Document(std::istream& in, size_t spacesPerTab=cDefaultSpacesPerTab);
 		~Document();
 
 		// You can call read() functions multiple times before writing if
-		// desirable. Once the document has been processed for writing, it can't
-		// accept any more input.
-		bool read(const std::string&);
-		bool read(std::istream&);
-		void write(std::ostream&);
+		// desirable. Once the document has been processed for writing (or
+		// step() has been called), it can't accept any more input.
+		//
+		// All of them return false if `cancel` was triggered before they
+		// finished. A cancelled read() adds nothing to the document; after a
+		// cancelled write(), later writes return false too.
+		bool read(const std::string&, const Cancellation *cancel=0);
+		bool read(std::istream&, const Cancellation *cancel=0);
+		bool write(std::ostream&, const Cancellation *cancel=0);
 		void writeTokens(std::ostream&); // For debugging
+		// Processes the whole document, like write() does, and writes it in
+		// the binary form that BinaryDocument (see markdown-binary.h) can
+		// write the same HTML from without parsing it again. Returns false
+		// if cancelled, or if it's too big for the format.
+		bool writeBinary(std::ostream&, const Cancellation *cancel=0);
+
+		// Reads all of `in` and writes it to `out`, with line splitting (and
+		// the HTML tag, inline HTML and link definition passes), block
+		// parsing, span processing and writing each on a thread of its own.
+		// Finished top-level blocks are handed down the line through bounded
+		// lock-free queues right away. The output, and the state the document
+		// is left in, are the same as from read() followed by write(). A block
+		// that refers to a link definition that hasn't been read yet (it may
+		// be further down) waits for it, or for the end of the input, and the
+		// blocks after it wait behind it.
+		//
+		// Only a document that hasn't read anything yet and has no budget
+		// can do this; for any other, it's read() followed by write().
+		bool convert(std::istream& in, std::ostream& out, const Cancellation
+			*cancel=0);
+
+		// Streaming: instead of using read() and write(), feed the document
+		// its input a piece at a time (the pieces needn't end at line breaks)
+		// and it writes the HTML of each top-level block to `out` as soon as
+		// the lines after it show that nothing more can be added to it. That's
+		// at a blank line followed by one that can't continue what came
+		// before it: not indented, quoted, a list item, a tag or a link
+		// definition. finish() writes the rest. Blocks are let go of once
+		// they're written, so memory use is bounded by the longest stretch of
+		// input without such a split in it, plus whatever the stream policy
+		// holds back. A streamed document can't be read into or written any
+		// other way, and budgets don't apply to it.
+		bool feed(std::ostream& out, const std::string& text, const
+			Cancellation *cancel=0);
+		bool finish(std::ostream& out, const Cancellation *cancel=0);
+		// The same, giving the blocks to `handler` as events. What's held as
+		// tokens is what's held for the HTML: the block in progress, plus any
+		// the stream policy holds back waiting for a link definition (up to
+		// its maxDeferredLines). So, unless that limit is turned off, it
+		// takes much less memory than read() followed by the event write().
+		bool feed(EventHandler& handler, const std::string& text, const
+			Cancellation *cancel=0);
+		bool finish(EventHandler& handler, const Cancellation *cancel=0);
+		// Or both the HTML and the events.
+		bool feed(std::ostream& out, EventHandler& handler, const std::string&
+			text, const Cancellation *cancel=0);
+		bool finish(std::ostream& out, EventHandler& handler, const
+			Cancellation *cancel=0);
+		void streamPolicy(const StreamPolicy& p) { mStreamPolicy=p; }
+		const StreamPolicy& streamPolicy() const { return mStreamPolicy; }
+
+		// Give the blocks to `handler` as events, where write() would write
+		// their HTML, with the same span processing first.
+		bool write(EventHandler& handler, const Cancellation *cancel=0);
+		bool write(EventHandler& handler, size_t firstBlock, size_t lastBlock,
+			const Cancellation *cancel=0);
+		// Both at once, a block at a time, from the one parse and span
+		// processing. An EventFanout (see markdown-render.h) lets `handler`
+		// be any number of renderers.
+		bool write(std::ostream& out, EventHandler& handler, const
+			Cancellation *cancel=0);
+		bool write(std::ostream& out, EventHandler& handler, size_t
+			firstBlock, size_t lastBlock, const Cancellation *cancel=0);
+
+		// Writes only the top-level blocks from `firstBlock` up to (but not
+		// including) `lastBlock`, and only does the span processing for those
+		// blocks. Writing every block in order gives the same output as
+		// write().
+		bool write(std::ostream&, size_t firstBlock, size_t lastBlock, const
+			Cancellation *cancel=0);
+		// Writes the top-level blocks that any of the source lines went into,
+		// the way the block range write() does. For exporting a section of
+		// the document, say, without processing the spans of the rest.
+		bool write(std::ostream&, const SourceRange& lines, const Cancellation
+			*cancel=0);
+		size_t blockCount();
+
+		// Writes the blocks like write() does, but without doing any span
+		// processing: blocks that haven't been through it yet come out with
+		// their structure (headers, lists, quotes, code) intact and their
+		// inline text escaped as it stands. It leaves them unrefined, so a
+		// later write() of the same blocks gives the finished HTML.
+		bool writeSkeleton(std::ostream&, size_t firstBlock, size_t lastBlock,
+			const Cancellation *cancel=0);
+		// Whether a write() has done the block's span processing yet.
+		bool isRefined(size_t block) const {
+			return (block<mSpansProcessed.size() && mSpansProcessed[block]);
+		}
+
+		// Processes the document first, like write() does.
+		const SourceIndex& sourceIndex();
+
+		// Finds the top-level headers of `source` (the ones write() would make
+		// of it) without processing the whole thing: a quick look at each line
+		// picks out the stretches between the places convert() can split the
+		// input that have a line that could be or underline a header, or
+		// start an inline HTML block. Only those go through the HTML and block
+		// passes, and nothing goes through span processing. The text is as
+		// write() would put it in the header. Returns false if cancelled.
+		static bool outline(const std::string& source, std::vector<Heading>&
+			headings, const Cancellation *cancel=0, size_t
+			spacesPerTab=cDefaultSpacesPerTab);
+
+		// Does the processing write() would start with, a slice at a time:
+		// works until `deadline` has passed, stopping between two top-level
+		// blocks, and picks up from there on the next call. Returns true once
+		// there's nothing left to do (which includes being cancelled); after
+		// that, write() only has the span processing of the blocks it writes
+		// left to do. A time budget counts only the time spent in here.
+		bool step(Cancellation::Clock::time_point deadline, const Cancellation
+			*cancel=0);
+
+		const Timings& timings() const { return mTimings; }
+
+		// Set the budget before the first read(). Once it has been exceeded,
+		// the document is written as the budget's fallback instead, and
+		// overBudget() says which limit it ran into.
+		void budget(const Budget& b) { mBudget=b; }
+		const Budget& budget() const { return mBudget; }
+		OverBudget overBudget() const { return mOverBudget; }
+
+		// With a pool of more than one thread, write() spreads the span
+		// processing of the blocks it's asked for over the pool's threads, a
+		// top-level block per job; and a large document's block parsing is
+		// split into chunks at blank lines that nothing can continue past,
+		// which are parsed in parallel (except when step() is doing it).
+		// Writing renders runs of top-level blocks into buffers of their own
+		// on the pool too, and puts them together into one piece of output. The
+		// output is the same either way. The pool isn't owned by the
+		// document, and has to outlive its writes.
+		void pool(WorkPool *p) { mPool=p; }
+		WorkPool *pool() const { return mPool; }
 
 		// The class is marked noncopyable because it uses reference-counted
 		// links to things that get changed during processing. If you want to
@@ -50,18 +373,93 @@ namespace markdown {
 
 		private:
 		bool _getline(std::istream& in, std::string& line);
-		void _process();
-		void _mergeMultilineHtmlTags();
-		void _processInlineHtmlAndReferences();
-		void _processBlocksItems(TokenPtr inTokenContainer);
-		void _processParagraphLines(TokenPtr inTokenContainer);
+		struct PassState;
+		typedef const Cancellation::Clock::time_point *Deadline;
+
+		bool _process(const Cancellation *cancel=0);
+		void _runPasses(const Cancellation *cancel, Deadline deadline);
+		bool _mergeMultilineHtmlTags(TokenPtr inTokenContainer, PassState& state,
+			const Cancellation *cancel, Deadline deadline);
+		bool _processInlineHtmlAndReferences(TokenPtr inTokenContainer,
+			PassState& state, const Cancellation *cancel, Deadline deadline);
+		bool _processBlocksItems(TokenPtr inTokenContainer, PassState& state,
+			const Cancellation *cancel, Deadline deadline);
+		bool _processParagraphLines(TokenPtr inTokenContainer, PassState& state,
+			const Cancellation *cancel, Deadline deadline);
+		struct Pipeline;
+		void _readStage(Pipeline& p, std::istream& in);
+		void _blockStage(Pipeline& p);
+		void _spanStage(Pipeline& p);
+		bool _refinedEarly(Pipeline& p, TokenPtr& block, std::vector<std::string>&
+			misses);
+		void _writeStage(Pipeline& p, std::ostream& out);
+		struct StreamState;
+		// Where streaming sends finished blocks: either or both.
+		struct StreamOutput {
+			std::ostream *html;
+			EventHandler *events;
 
-		static const size_t cSpacesPerInitialTab, cDefaultSpacesPerTab;
+			StreamOutput(std::ostream *html_, EventHandler *events_):
+				html(html_), events(events_) { }
+		};
+		bool _feed(const StreamOutput& out, const std::string& text, const
+			Cancellation *cancel);
+		bool _finish(const StreamOutput& out, const Cancellation *cancel);
+		void _streamLines(const StreamOutput& out, std::istream& in, bool last,
+			const Cancellation *cancel);
+		void _streamChunk(const StreamOutput& out, bool last, const
+			Cancellation *cancel);
+		void _writeStreamed(const StreamOutput& out, bool all, const
+			Cancellation *cancel);
+
+		bool _processBlocksInChunks(const Cancellation *cancel);
+		// What a batch of pool jobs share: whether one was cancelled, and the
+		// first exception any of them threw.
+		struct JobState;
+		void _chunkJob(const std::vector<TokenPtr> *chunks, const Cancellation
+			*cancel, JobState *state, size_t job);
+		bool _processSpans(size_t firstBlock, size_t lastBlock, const
+			Cancellation *cancel);
+		bool _processBlockSpans(size_t block, const Cancellation *cancel);
+		TokenPtr _refined(TokenPtr block, const Cancellation *cancel) const;
+		void _spanJob(const std::vector<size_t> *blocks, const Cancellation
+			*cancel, JobState *state, size_t job);
+		bool _writeBlocks(std::ostream *out, EventHandler *events, size_t
+			firstBlock, size_t lastBlock, const Cancellation *cancel);
+		void _htmlJob(size_t firstBlock, size_t lastBlock, std::vector<
+			std::string> *html, const Cancellation *cancel, JobState *state,
+			size_t job);
+		static void _copyHtmlJob(const std::vector<std::string> *html, const
+			std::vector<size_t> *offsets, char *out, JobState *state, size_t job);
+		bool _outlineChunk(const std::string& text, size_t firstLine, bool last,
+			bool findHeaders, std::vector<Heading>& headings, const Cancellation
+			*cancel);
+		void _keepForFallback(const std::string& line, const std::string&
+			previousLine, size_t lineNumber);
+		void _buildFallback();
+
+		static const size_t cSpacesPerInitialTab, cMinChunkTokens,
+			cPipelineChunkLines, cWriteRunsPerThread;
 
 		const size_t cSpacesPerTab;
 		TokenPtr mTokenContainer;
 		LinkIds *mIdTable;
-		bool mProcessed;
+		SourceIndex mSourceIndex;
+		std::vector<TokenPtr> mBlocks;
+		std::vector<bool> mSpansProcessed;
+		WorkPool *mPool;
+		Timings mTimings;
+		PassState *mPasses; // While step() is partway through
+		StreamState *mStream; // Once feed() has been called
+		StreamPolicy mStreamPolicy;
+		size_t mLineCount;
+		bool mProcessed, mCancelled;
+
+		Budget mBudget;
+		OverBudget mOverBudget;
+		size_t mSourceBytes;
+		std::string mFallbackSource;
+		std::vector<Heading> mFallbackHeadings;
 	};
 
 } // namespace markdown
@@ -0,0 +1,137 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// abort-latency: cancels the processing of a large document from another
+// thread, at several points along the way, and checks how long write() and
+// step() take to notice. The points are fractions of the time the
+// uncancelled call takes, so they land in different passes whatever the
+// speed of the machine.
+
+#include "markdown.h"
+#include "markdown-pool.h"
+#include "corpus.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace {
+
+typedef markdown::Cancellation::Clock Clock;
+typedef boost::chrono::microseconds Microseconds;
+
+const size_t cBlocks=20000;
+const double cMaxLatencyMs=100;
+const double cCancelPoints[]={ 0.05, 0.2, 0.4, 0.6, 0.8 };
+const int cTries=4;
+
+double ms(Clock::duration d) {
+	return boost::chrono::duration_cast<Microseconds>(d).count()/1000.0;
+}
+
+struct Canceller {
+	markdown::Cancellation *cancel;
+	Clock::time_point at, *cancelledAt;
+
+	void operator()() const {
+		boost::this_thread::sleep_until(at);
+		*cancelledAt=Clock::now();
+		cancel->cancel();
+	}
+};
+
+enum Entry { cWrite, cStep };
+
+// What abortLatency() gives if the call got to the end of its work before
+// it noticed the cancel, which the variation in timings can make it do at
+// the later points.
+const double cFinished=-1;
+
+// The time from cancelling to the call returning.
+double abortLatency(const std::string& source, Entry entry,
+	markdown::WorkPool *pool, Clock::duration after)
+{
+	markdown::Document doc;
+	if (pool!=0) doc.pool(pool);
+	doc.read(source);
+
+	markdown::Cancellation cancel;
+	Clock::time_point cancelledAt;
+	Canceller c={ &cancel, Clock::now()+after, &cancelledAt };
+	boost::thread canceller(c);
+
+	bool stopped;
+	Clock::time_point returnedAt;
+	std::ostringstream out;
+	if (entry==cWrite) {
+		stopped=!doc.write(out, &cancel);
+		returnedAt=Clock::now();
+	} else {
+		doc.step(Clock::now()+boost::chrono::hours(1), &cancel);
+		returnedAt=Clock::now();
+		// A cancelled step leaves nothing that can be written.
+		stopped=!doc.write(out);
+	}
+	canceller.join();
+
+	if (!stopped) return cFinished;
+	return ms(returnedAt-cancelledAt);
+}
+
+} // namespace
+
+int main() {
+	const std::string source=corpus::generate(1, cBlocks);
+
+	Clock::duration full[2];
+	for (int entry=cWrite; entry<=cStep; ++entry) {
+		markdown::Document doc;
+		doc.read(source);
+		Clock::time_point start=Clock::now();
+		if (entry==cWrite) {
+			std::ostringstream out;
+			doc.write(out);
+		} else doc.step(Clock::now()+boost::chrono::hours(1));
+		full[entry]=Clock::now()-start;
+	}
+	std::cout << source.size() << " bytes, uncancelled write " << std::fixed
+		<< std::setprecision(1) << ms(full[cWrite]) << " ms, step " <<
+		ms(full[cStep]) << " ms\n";
+
+	markdown::WorkPool pool(4);
+	const char *names[]={ "write", "step", "pooled write" };
+	bool ok=true;
+	for (int kind=0; kind<3; ++kind) {
+		const Entry entry=(kind==1 ? cStep : cWrite);
+		std::cout << std::setw(13) << names[kind] << ':';
+		for (size_t p=0; p<sizeof(cCancelPoints)/sizeof(cCancelPoints[0]); ++p) {
+			Clock::duration after=boost::chrono::duration_cast<Clock::duration>(
+				full[entry]*cCancelPoints[p]);
+			// If it finished, try again earlier, so each point gets measured.
+			double latency=cFinished;
+			for (int tries=0; tries<cTries && latency==cFinished; ++tries) {
+				latency=abortLatency(source, entry, (kind==2 ? &pool : 0), after);
+				after/=2;
+			}
+			if (latency==cFinished) {
+				std::cout << "  not stopped";
+				ok=false;
+			} else {
+				std::cout << std::setw(8) << latency << " ms";
+				if (latency>cMaxLatencyMs) ok=false;
+			}
+		}
+		std::cout << '\n';
+	}
+
+	if (!ok) std::cerr << "an abort took longer than " << cMaxLatencyMs
+		<< " ms, or didn't happen\n";
+	return (ok ? 0 : 1);
+}
@@ -0,0 +1,127 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// bench-pipeline [keystrokes] [file...]: keystroke-to-HTML latency of the
+// preview path. Replays typing sessions, one keystroke at a time, against
+// each document (the files given, or generated ones of several sizes)
+// through CPreviewPipeline, with a stub editor and browser. After each
+// keystroke it calls Refresh(), then FillPending() until nothing is left, as
+// the preview's timer would (without the pauses between ticks), and takes
+// two times: until the first HTML reached the sink, which is when the
+// preview changes, and until all of it had.
+
+#include "PreviewPipeline.h"
+#include "corpus.h"
+#include "stub-host.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+using stub::Clock;
+
+// As typed, with '\b' for backspace: a paragraph, a list, a header and
+// some spans, each with a typo or two corrected along the way.
+const char *cSessions[]={
+	"A new paragraph, with *emphasis* and a typp\bo or two in tit\b\bit.\n\n",
+	"* a list item\n* anoter\b\b\bther one\n    * nested\n\n",
+	"## A heading of its own\n\nAnd some text under it.\n\n",
+	"Inline `code`, a [link](http://example.com/) and AT&T.  \nThen more.\n\n",
+	"> quoted, and **strong**\b\b\b\b\b\b\b\b\b\b*weak*\n\n"
+};
+
+// The preview's own timer slice (CPreviewDlg::cFillSliceMs).
+const unsigned cFillSliceMs=30;
+
+double ms(Clock::duration d) {
+	return boost::chrono::duration_cast<boost::chrono::microseconds>(d)
+		.count()/1000.0;
+}
+
+double percentile(std::vector<double> v, double fraction) {
+	std::sort(v.begin(), v.end());
+	size_t i=static_cast<size_t>(fraction*v.size());
+	return v[std::min(i, v.size()-1)];
+}
+
+void bench(const std::string& name, const std::string& source, size_t
+	keystrokes)
+{
+	stub::Buffer buffer;
+	stub::Sink sink;
+	CPreviewPipeline pipeline(buffer, sink);
+	buffer.text()=source;
+	pipeline.Refresh();
+	while (pipeline.FillPending(cFillSliceMs)) { }
+	Clock::time_point ignored;
+	sink.published(ignored);
+
+	// Each session starts typing at the beginning of a line picked at random.
+	corpus::Random random(static_cast<unsigned>(source.size()));
+	std::vector<double> shown, complete;
+	const char *typing=0;
+	for (size_t k=0, session=0; k<keystrokes; ++k) {
+		if (typing==0 || *typing==0) {
+			size_t at=buffer.text().find('\n', random.next(32768)*
+				buffer.text().size()/32768);
+			buffer.caret(at==std::string::npos ? buffer.text().size() : at+1);
+			typing=cSessions[session++%(sizeof(cSessions)/sizeof(cSessions[0]))];
+		}
+
+		Clock::time_point start=Clock::now();
+		if (*typing=='\b') buffer.backspace();
+		else buffer.type(*typing);
+		++typing;
+		pipeline.Refresh();
+		while (pipeline.FillPending(cFillSliceMs)) { }
+		Clock::time_point end=Clock::now(), first;
+
+		complete.push_back(ms(end-start));
+		if (sink.published(first)) shown.push_back(ms(first-start));
+	}
+
+	std::cout << std::setw(14) << name << std::setw(8) << std::count(
+		source.begin(), source.end(), '\n') << std::setw(6) << keystrokes
+		<< std::fixed << std::setprecision(1);
+	if (shown.empty()) std::cout << std::setw(20) << "-";
+	else std::cout << std::setw(10) << percentile(shown, 0.5) << std::setw(10)
+		<< percentile(shown, 0.99);
+	std::cout << std::setw(10) << percentile(complete, 0.5) << std::setw(10)
+		<< percentile(complete, 0.99) << '\n';
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	size_t keystrokes=100;
+	if (argc>1) keystrokes=std::strtoul(argv[1], 0, 10);
+	if (keystrokes==0) keystrokes=1;
+
+	std::cout << "                                  shown ms          complete ms\n"
+		"      document   lines  keys       p50       p99       p50       p99\n";
+	if (argc>2) {
+		for (int a=2; a<argc; ++a) {
+			std::string source;
+			if (!corpus::readFile(argv[a], source)) {
+				std::cerr << "can't read " << argv[a] << '\n';
+				return 1;
+			}
+			bench(argv[a], source, keystrokes);
+		}
+	} else {
+		const size_t sizes[]={ 50, 1000, 10000 };
+		for (size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); ++s) {
+			std::ostringstream name;
+			name << sizes[s] << " blocks";
+			bench(name.str(), corpus::generate(1, sizes[s]), keystrokes);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,99 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// bench-scaling [maxThreads] [file...]: how the pooled stages (chunked block
+// parsing, span processing and writing) scale from one thread up to
+// maxThreads (by default, the hardware's), on the files given or on a
+// generated document of about 70,000 lines. Each count is the best of a few
+// runs; one thread is the serial, pool-less path.
+
+#include "markdown.h"
+#include "markdown-pool.h"
+#include "corpus.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace {
+
+typedef boost::chrono::steady_clock Clock;
+
+const int cRuns=3;
+
+struct Result {
+	double blocks, spans, write, total; // Milliseconds
+
+	Result(): blocks(0), spans(0), write(0), total(0) { }
+};
+
+Result measure(const std::string& source, size_t threads) {
+	Result best;
+	for (int run=0; run<cRuns; ++run) {
+		markdown::WorkPool *pool=(threads>1 ? new markdown::WorkPool(threads) : 0);
+		Clock::time_point start=Clock::now();
+		markdown::Document doc;
+		if (pool!=0) doc.pool(pool);
+		doc.read(source);
+		std::ostringstream out;
+		doc.write(out);
+		double total=boost::chrono::duration_cast<boost::chrono::microseconds>(
+			Clock::now()-start).count()/1000.0;
+		const markdown::Timings& t=doc.timings();
+
+		Result r;
+		r.blocks=(t.blocks+t.paragraphs)/1000.0;
+		r.spans=t.spans/1000.0;
+		r.write=t.write/1000.0;
+		r.total=total;
+		if (run==0 || r.total<best.total) best=r;
+		delete pool;
+	}
+	return best;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	size_t maxThreads=boost::thread::hardware_concurrency();
+	if (argc>1) maxThreads=std::strtoul(argv[1], 0, 10);
+	if (maxThreads==0) maxThreads=1;
+
+	std::string source;
+	for (int a=2; a<argc; ++a) {
+		std::string text;
+		if (!corpus::readFile(argv[a], text)) {
+			std::cerr << "can't read " << argv[a] << '\n';
+			return 1;
+		}
+		source+=text+"\n\n";
+	}
+	if (source.empty()) source=corpus::generate(1, 20000);
+
+	std::vector<size_t> counts;
+	for (size_t t=1; t<maxThreads; t*=2) counts.push_back(t);
+	counts.push_back(maxThreads);
+
+	std::cout << source.size() << " bytes, " << boost::thread::hardware_concurrency()
+		<< " hardware threads\n"
+		<< "threads   blocks ms    spans ms    write ms    total ms  speedup\n"
+		<< std::fixed << std::setprecision(1);
+	double serial=0;
+	for (size_t i=0; i<counts.size(); ++i) {
+		Result r=measure(source, counts[i]);
+		if (i==0) serial=r.total;
+		std::cout << std::setw(7) << counts[i] << std::setw(12) << r.blocks <<
+			std::setw(12) << r.spans << std::setw(12) << r.write << std::setw(12)
+			<< r.total << std::setw(8) << std::setprecision(2) << serial/r.total
+			<< "x\n" << std::setprecision(1);
+	}
+	return 0;
+}
@@ -0,0 +1,103 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// binary-roundtrip: checks that a document saved with writeBinary() and
+// loaded into a BinaryDocument writes the same HTML as Document::write(),
+// whole and a range of blocks at a time, that the binary form only takes a
+// table entry a block more than the HTML, and that damaged data is refused.
+
+#include "markdown.h"
+#include "markdown-binary.h"
+#include "corpus.h"
+
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstddef>
+
+namespace {
+
+const unsigned cDocuments=12, cBlocksStep=60;
+
+int failures=0;
+
+void check(bool ok, const std::string& name, const char *what) {
+	if (ok) return;
+	std::cerr << name << ": " << what << '\n';
+	++failures;
+}
+
+// Copied into uint32s, so it's aligned the way load() needs.
+bool load(markdown::BinaryDocument& doc, const std::string& data,
+	std::vector<markdown::binary::uint32>& memory)
+{
+	memory.assign(data.size()/sizeof(markdown::binary::uint32)+1, 0);
+	if (!data.empty()) std::memcpy(&memory[0], data.data(), data.size());
+	return doc.load(reinterpret_cast<const char*>(&memory[0]), data.size());
+}
+
+void roundTrip(const std::string& name, const std::string& source) {
+	markdown::Document doc;
+	doc.read(source);
+	std::ostringstream html, saved;
+	doc.write(html);
+	check(doc.writeBinary(saved), name, "writeBinary() failed");
+
+	const std::string data=saved.str();
+	std::vector<markdown::binary::uint32> memory;
+	markdown::BinaryDocument bin;
+	if (!load(bin, data, memory)) {
+		check(false, name, "load() refused it");
+		return;
+	}
+	check(bin.blockCount()==doc.blockCount(), name, "block count");
+	check(data.size()==sizeof(markdown::binary::Header)+html.str().size()+
+		doc.blockCount()*sizeof(markdown::binary::uint32), name, "size");
+
+	std::ostringstream all;
+	bin.write(all);
+	check(all.str()==html.str(), name, "write() differs");
+
+	const size_t blocks=bin.blockCount();
+	if (blocks==0) return;
+	const size_t ranges[][2]={ { 0, 1 }, { 0, blocks/2 }, { blocks/3,
+		blocks*2/3 }, { blocks-1, blocks }, { blocks/2, blocks+10 } };
+	for (size_t r=0; r<sizeof(ranges)/sizeof(ranges[0]); ++r) {
+		std::ostringstream wanted, got;
+		doc.write(wanted, ranges[r][0], ranges[r][1]);
+		bin.write(got, ranges[r][0], ranges[r][1]);
+		check(got.str()==wanted.str(), name, "a range of blocks differs");
+	}
+
+	// Cut short, with its table out of order, or from another version.
+	markdown::BinaryDocument bad;
+	check(!load(bad, data.substr(0, data.size()-1), memory) && bad.empty(),
+		name, "a truncated file was loaded");
+	std::string unordered=data;
+	const markdown::binary::uint32 past=markdown::binary::uint32(
+		html.str().size()+1);
+	std::memcpy(&unordered[sizeof(markdown::binary::Header)], &past,
+		sizeof(past));
+	check(!load(bad, unordered, memory), name, "a table out of order was "
+		"loaded");
+	std::string old=data;
+	old[offsetof(markdown::binary::Header, version)]^=3;
+	check(!load(bad, old, memory), name, "another version was loaded");
+}
+
+} // namespace
+
+int main() {
+	for (unsigned d=1; d<=cDocuments; ++d) {
+		std::ostringstream name;
+		name << "document " << d;
+		roundTrip(name.str(), corpus::generate(300+d, d*cBlocksStep));
+	}
+	roundTrip("empty", std::string());
+
+	if (failures==0) std::cout << "all passed\n";
+	return (failures==0 ? 0 : 1);
+}
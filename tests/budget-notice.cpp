@@ -0,0 +1,49 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// budget-notice: the note CPreviewPipeline puts above a document that's over
+// its size limit gives the limit in a unit that fits it.
+
+#include "PreviewPipeline.h"
+#include "stub-host.h"
+
+#include <iostream>
+
+namespace {
+
+int failures=0;
+
+void expect(size_t limit, const wchar_t *text) {
+	stub::Buffer buffer;
+	stub::Sink sink;
+	CPreviewPipeline pipeline(buffer, sink);
+	markdown::Budget budget;
+	budget.maxSourceBytes=limit;
+	pipeline.SetBudget(budget);
+
+	while (buffer.text().size()<=limit) buffer.text()+="Some words.\n\n";
+	pipeline.Refresh();
+	while (pipeline.FillPending(30)) { }
+
+	std::wstring wanted=std::wstring(L"limit of ")+text+L",";
+	if (sink.body.find(wanted)==std::wstring::npos) {
+		std::wcerr << L"no \"" << wanted << L"\" for a limit of " << limit << L'\n';
+		++failures;
+	}
+}
+
+} // namespace
+
+int main() {
+	expect(512, L"512 bytes");
+	expect(300*1024, L"300.0 KB");
+	expect(1000*1000, L"976.6 KB");
+	expect(1536*1024, L"1.5 MB");
+	expect(2*1024*1024, L"2.0 MB");
+
+	if (failures==0) std::cout << "all passed\n";
+	return (failures==0 ? 0 : 1);
+}
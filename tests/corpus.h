@@ -0,0 +1,130 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_TESTS_CORPUS_H_INCLUDED
+#define MARKDOWN_TESTS_CORPUS_H_INCLUDED
+
+#include <string>
+#include <sstream>
+#include <fstream>
+
+// Made-up Markdown for the tests and benchmarks: a seeded mix of every kind
+// of block the engine knows, with the span elements, nesting and odd
+// spacing that make block boundaries interesting (lists and quotes that
+// run on lazily, blank lines inside code and HTML blocks, setext
+// underlines, link definitions before and after their uses). The same seed
+// gives the same document everywhere.
+namespace corpus {
+
+class Random {
+	public:
+	explicit Random(unsigned seed): mState(seed*2654435761u+1) { }
+
+	unsigned next(unsigned n) {
+		mState=mState*1103515245u+12345u;
+		return ((mState>>16)&0x7fff)%n;
+	}
+
+	private:
+	unsigned mState;
+};
+
+inline std::string sentence(Random& r, size_t n) {
+	static const char *words[]={ "alpha", "beta", "*gamma*", "**delta**",
+		"`code & span`", "[link][ref3]", "[inline](http://example.com/a \"T\")",
+		"<span>html</span>", "AT&T", "x < y", "_under_", "__strong__",
+		"![image](/i.png)", "<http://auto.link/>", "\\*escaped\\*", "***both***",
+		"word", "text", "the", "and" };
+	std::string s;
+	for (size_t i=0; i<n; ++i) {
+		if (i!=0) s+=' ';
+		s+=words[r.next(sizeof(words)/sizeof(words[0]))];
+	}
+	return s;
+}
+
+inline void block(Random& r, std::ostringstream& out, size_t n) {
+	switch (r.next(13)) {
+		case 0: case 1:
+			out << sentence(r, 3+r.next(10)) << '\n' << sentence(r, 2+r.next(8))
+				<< '\n';
+			break;
+		case 2:
+			out << std::string(1+r.next(6), '#') << " Header " << n << '\n';
+			break;
+		case 3:
+			out << "Setext " << n << '\n' << (r.next(2) ? "=====" : "-----") <<
+				'\n';
+			break;
+		case 4:
+			for (size_t i=0, ie=1+r.next(5); i<ie; ++i) {
+				out << (r.next(2) ? "* " : "- ") << sentence(r, 2+r.next(5)) << '\n';
+				if (r.next(3)==0) out << "    * nested " << sentence(r, 2) << '\n';
+				if (r.next(4)==0) out << "lazy continuation\n";
+				if (r.next(4)==0) out << "\n    second paragraph\n";
+			}
+			break;
+		case 5:
+			for (size_t i=0, ie=1+r.next(4); i<ie; ++i)
+				out << (i+1) << ". " << sentence(r, 2+r.next(4)) << '\n';
+			break;
+		case 6:
+			out << "> " << sentence(r, 4) << '\n';
+			if (r.next(2)) out << "> * quoted item\n";
+			if (r.next(2)) out << "lazy quote line\n";
+			if (r.next(3)==0) out << ">\n> > nested quote\n";
+			break;
+		case 7:
+			out << "    code line " << n << " <b>&</b>\n";
+			if (r.next(2)) out << "\n    after a blank line in the code\n";
+			out << "\tand a tab\n";
+			break;
+		case 8:
+			out << "<div class=\"d\">\n<p>inline *html* block</p>\n";
+			if (r.next(2)) out << "\n";
+			out << "</div>\n";
+			break;
+		case 9:
+			out << "[ref" << r.next(8) << "]: http://example.com/" << n <<
+				(r.next(2) ? "  \"Title\"" : "") << '\n';
+			break;
+		case 10:
+			out << (r.next(2) ? "* * *" : "- - -") << '\n';
+			break;
+		case 11:
+			out << "<!-- a comment\n" << "over lines -->\n";
+			break;
+		default:
+			out << sentence(r, 5) << "  \n" << sentence(r, 3) << '\n';
+			break;
+	}
+}
+
+// About three or four lines per block.
+inline std::string generate(unsigned seed, size_t blocks) {
+	Random r(seed);
+	std::ostringstream out;
+	for (size_t n=0; n<blocks; ++n) {
+		block(r, out, n);
+		unsigned gap=r.next(8);
+		if (gap!=0) out << '\n';
+		if (gap==1) out << '\n';
+	}
+	return out.str();
+}
+
+inline bool readFile(const char *path, std::string& text) {
+	std::ifstream in(path, std::ios::in | std::ios::binary);
+	if (!in) return false;
+	std::ostringstream all;
+	all << in.rdbuf();
+	text=all.str();
+	return true;
+}
+
+} // namespace corpus
+
+#endif // MARKDOWN_TESTS_CORPUS_H_INCLUDED
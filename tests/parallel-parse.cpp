@@ -0,0 +1,110 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// parallel-parse [file...]: checks that a document parsed in chunks on a
+// pool (see Document::pool()), or converted by the threaded pipeline of
+// Document::convert(), gives exactly the HTML that the serial parse does,
+// and that a document convert() has been through writes it again the same
+// way. With no files it uses generated documents: some of about 10,000
+// lines, which are always split into chunks, and many smaller ones, on both
+// sides of the size where chunking starts.
+
+#include "markdown.h"
+#include "markdown-pool.h"
+#include "corpus.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+namespace {
+
+const size_t cThreads=4;
+const unsigned cLargeDocuments=7, cLargeBlocks=3000;
+const unsigned cSmallDocuments=45, cSmallBlocksStep=20;
+
+std::string convert(const std::string& source, markdown::WorkPool *pool) {
+	markdown::Document doc;
+	if (pool!=0) doc.pool(pool);
+	doc.read(source);
+	std::ostringstream out;
+	doc.write(out);
+	return out.str();
+}
+
+// From convert(), then from write() on the same document.
+std::string pipelined(const std::string& source, std::string& again) {
+	markdown::Document doc;
+	std::istringstream in(source);
+	std::ostringstream out, out2;
+	doc.convert(in, out);
+	doc.write(out2);
+	again=out2.str();
+	return out.str();
+}
+
+bool same(const std::string& name, const std::string& serial, const
+	std::string& parallel)
+{
+	if (serial==parallel) return true;
+
+	size_t at=std::mismatch(serial.begin(), serial.begin()+std::min(
+		serial.size(), parallel.size()), parallel.begin()).first-serial.begin();
+	size_t from=(at>40 ? at-40 : 0);
+	std::cerr << name << ": differs at byte " << at << "\n  serial:   "
+		<< serial.substr(from, 80) << "\n  parallel: " << parallel.substr(from, 80)
+		<< '\n';
+	return false;
+}
+
+bool check(const std::string& name, const std::string& source,
+	markdown::WorkPool& pool)
+{
+	const std::string serial=convert(source, 0);
+	std::string again;
+	const std::string converted=pipelined(source, again);
+	bool chunked=same(name+" (chunked)", serial, convert(source, &pool)),
+		piped=same(name+" (convert)", serial, converted),
+		rewritten=same(name+" (write after convert)", serial, again);
+	return (chunked && piped && rewritten);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	markdown::WorkPool pool(cThreads);
+	size_t checked=0, failed=0;
+
+	if (argc>1) {
+		for (int a=1; a<argc; ++a) {
+			std::string source;
+			if (!corpus::readFile(argv[a], source)) {
+				std::cerr << "can't read " << argv[a] << '\n';
+				return 1;
+			}
+			++checked;
+			if (!check(argv[a], source, pool)) ++failed;
+		}
+	} else {
+		for (unsigned s=1; s<=cLargeDocuments; ++s) {
+			std::ostringstream name;
+			name << "large " << s;
+			++checked;
+			if (!check(name.str(), corpus::generate(s, cLargeBlocks), pool))
+				++failed;
+		}
+		for (unsigned s=1; s<=cSmallDocuments; ++s) {
+			std::ostringstream name;
+			name << "small " << s;
+			++checked;
+			if (!check(name.str(), corpus::generate(100+s, s*cSmallBlocksStep),
+				pool)) ++failed;
+		}
+	}
+
+	std::cout << checked-failed << " of " << checked << " documents match\n";
+	return (failed==0 ? 0 : 1);
+}
@@ -0,0 +1,122 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// pipeline-soak [cycles]: edits and refreshes a document through
+// CPreviewPipeline thousands of times, with a stub editor and browser, and
+// checks that the process's resident memory and open file descriptors stay
+// where they were after a warm-up. Typing and then deleting the same text
+// keeps the document the same size throughout, so anything that keeps
+// growing is a leak. Runs on Linux, where /proc has the numbers.
+
+#include "PreviewPipeline.h"
+#include "corpus.h"
+#include "stub-host.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+
+namespace {
+
+const size_t cDefaultCycles=2000, cWarmUpCycles=200;
+const long cMaxGrowthKb=4096;
+const char cTyped[]="Some *new* text, with a [link](http://example.com/).";
+
+// Resident memory, in kilobytes.
+long residentKb() {
+	std::ifstream statm("/proc/self/statm");
+	long size=0, resident=0;
+	statm >> size >> resident;
+	return resident*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+long openFiles() {
+	long count=0;
+	for (boost::filesystem::directory_iterator i("/proc/self/fd"), ie; i!=ie;
+		++i) ++count;
+	return count;
+}
+
+// One edit and refresh: typing cTyped a character at a time, then
+// backspacing over it, then starting again somewhere else.
+class Editor {
+	public:
+	Editor(const std::string& source, bool progressive): mPipeline(mBuffer,
+		mSink), mRandom(7), mTyped(0), mDeleting(false)
+	{
+		mBuffer.text()=source;
+		mPipeline.SetProgressive(progressive);
+	}
+
+	void cycle() {
+		if (mTyped==0 && !mDeleting) {
+			size_t at=mBuffer.text().find('\n', mRandom.next(32768)*
+				mBuffer.text().size()/32768);
+			mBuffer.caret(at==std::string::npos ? mBuffer.text().size() : at+1);
+		}
+		if (mDeleting) {
+			mBuffer.backspace();
+			if (--mTyped==0) mDeleting=false;
+		} else {
+			mBuffer.type(cTyped[mTyped]);
+			if (++mTyped==sizeof(cTyped)-1) mDeleting=true;
+		}
+		mPipeline.Refresh();
+		while (mPipeline.FillPending(30)) { }
+	}
+
+	const stub::Sink& sink() const { return mSink; }
+
+	private:
+	stub::Buffer mBuffer;
+	stub::Sink mSink;
+	CPreviewPipeline mPipeline;
+	corpus::Random mRandom;
+	size_t mTyped;
+	bool mDeleting;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	size_t cycles=cDefaultCycles;
+	if (argc>1) cycles=std::strtoul(argv[1], 0, 10);
+
+	// One document small enough to be published whole, and one big enough to
+	// go through the viewport and FillPending() path, with and without
+	// skeletons.
+	Editor small(corpus::generate(2, 100), true), large(corpus::generate(3,
+		400), true), plain(corpus::generate(4, 400), false);
+	Editor *editors[]={ &small, &large, &plain };
+
+	for (size_t c=0; c<cWarmUpCycles; ++c) editors[c%3]->cycle();
+	const long startKb=residentKb(), startFiles=openFiles();
+
+	for (size_t c=0; c<cycles; ++c) editors[c%3]->cycle();
+	const long endKb=residentKb(), endFiles=openFiles();
+
+	unsigned long published=0;
+	for (size_t e=0; e<3; ++e)
+		published+=editors[e]->sink().bodies+editors[e]->sink().blocks;
+	std::cout << cycles << " refreshes, " << published << " bodies and blocks "
+		"published\nresident " << startKb << " KB -> " << endKb << " KB, open "
+		"files " << startFiles << " -> " << endFiles << '\n';
+
+	bool ok=true;
+	if (endKb-startKb>cMaxGrowthKb) {
+		std::cerr << "resident memory grew by more than " << cMaxGrowthKb
+			<< " KB\n";
+		ok=false;
+	}
+	if (endFiles>startFiles) {
+		std::cerr << "file descriptors leaked\n";
+		ok=false;
+	}
+	return (ok ? 0 : 1);
+}
@@ -0,0 +1,105 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// refresh-policy: CRefreshPolicy's decisions, fed with made-up render times.
+
+#include "RefreshPolicy.h"
+
+#include <iostream>
+#include <cmath>
+
+namespace {
+
+int failures=0;
+
+void check(bool ok, const char *what, int line) {
+	if (ok) return;
+	std::cerr << "line " << line << ": " << what << '\n';
+	++failures;
+}
+
+#define CHECK(x) check((x), #x, __LINE__)
+
+bool decides(const CRefreshPolicy& policy, CRefreshPolicy::BufferKey buffer,
+	CRefreshPolicy::Action action, unsigned delayMs)
+{
+	CRefreshPolicy::Decision d=policy.OnModified(buffer);
+	return (d.action==action && d.delayMs==delayMs);
+}
+
+bool near(double a, double b) { return std::fabs(a-b)<1e-9; }
+
+} // namespace
+
+int main() {
+	int a, b;
+	const CRefreshPolicy::BufferKey one=&a, two=&b;
+
+	{
+		// Defaults: 30 ms input budget, idle past 1000 ms, 1500 ms idle delay.
+		CRefreshPolicy policy;
+		CHECK(policy.AverageMs(one)<0);
+		CHECK(decides(policy, one, CRefreshPolicy::cRefreshNow, 0));
+
+		policy.RecordRender(one, 30);
+		CHECK(near(policy.AverageMs(one), 30));
+		CHECK(decides(policy, one, CRefreshPolicy::cRefreshNow, 0));
+
+		// The newest render counts for 0.3 of the average.
+		policy.RecordRender(one, 130);
+		CHECK(near(policy.AverageMs(one), 60));
+		CHECK(decides(policy, one, CRefreshPolicy::cDebounce, 120));
+
+		// Buffers are kept apart, and one that's forgotten starts over.
+		CHECK(policy.AverageMs(two)<0);
+		CHECK(decides(policy, two, CRefreshPolicy::cRefreshNow, 0));
+		policy.Forget(one);
+		CHECK(policy.AverageMs(one)<0);
+		CHECK(decides(policy, one, CRefreshPolicy::cRefreshNow, 0));
+	}
+
+	{
+		CRefreshPolicy policy;
+
+		// The debounce delay is twice the expected render time, but at least
+		// 50 ms and at most the idle delay.
+		policy.SetInputBudgetMs(10);
+		CHECK(policy.InputBudgetMs()==10);
+		policy.RecordRender(one, 20);
+		CHECK(decides(policy, one, CRefreshPolicy::cDebounce, 50));
+		policy.RecordRender(two, 900);
+		CHECK(decides(policy, two, CRefreshPolicy::cDebounce, 1500));
+
+		// Past the idle threshold, it waits for the editor to go idle.
+		policy.Forget(two);
+		policy.RecordRender(two, 1000);
+		CHECK(decides(policy, two, CRefreshPolicy::cDebounce, 1500));
+		policy.RecordRender(two, 1001);
+		CHECK(decides(policy, two, CRefreshPolicy::cIdleOnly, 1500));
+
+		// And comes back as the renders get cheaper.
+		for (int i=0; i<30; ++i) policy.RecordRender(two, 5);
+		CHECK(decides(policy, two, CRefreshPolicy::cRefreshNow, 0));
+	}
+
+	{
+		CRefreshPolicy policy(100, 400, 600);
+		policy.RecordRender(one, 100);
+		CHECK(decides(policy, one, CRefreshPolicy::cRefreshNow, 0));
+		policy.Forget(one);
+		policy.RecordRender(one, 250);
+		CHECK(decides(policy, one, CRefreshPolicy::cDebounce, 500));
+		policy.Forget(one);
+		policy.RecordRender(one, 350);
+		CHECK(decides(policy, one, CRefreshPolicy::cDebounce, 600));
+		policy.Forget(one);
+		policy.RecordRender(one, 401);
+		CHECK(decides(policy, one, CRefreshPolicy::cIdleOnly, 600));
+	}
+
+	if (failures==0) std::cout << "all passed\n";
+	return (failures==0 ? 0 : 1);
+}
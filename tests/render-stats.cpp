@@ -0,0 +1,95 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// render-stats: CRollingHistogram's buckets, window and percentiles, and the
+// summary line CRenderStats makes from them.
+
+#include "RenderStats.h"
+
+#include <iostream>
+
+namespace {
+
+int failures=0;
+
+void check(bool ok, const char *what, int line) {
+	if (ok) return;
+	std::cerr << "line " << line << ": " << what << '\n';
+	++failures;
+}
+
+#define CHECK(x) check((x), #x, __LINE__)
+
+bool contains(const std::wstring& s, const wchar_t *part) {
+	return (s.find(part)!=std::wstring::npos);
+}
+
+} // namespace
+
+int main() {
+	{
+		CRollingHistogram h;
+		CHECK(h.Count()==0);
+		CHECK(h.Last()==0);
+		CHECK(h.Percentile(0.5)==0);
+
+		// A percentile is the upper bound of its power-of-two bucket.
+		h.Add(0);
+		CHECK(h.Percentile(1)==0);
+		h.Add(1000);
+		CHECK(h.Last()==1000);
+		CHECK(h.Percentile(1)==1023);
+		CHECK(h.Percentile(0.1)==0);
+
+		// Times past the last bucket go in it.
+		h.Add(1ULL<<50);
+		CHECK(h.Percentile(1)==(1ULL<<(CRollingHistogram::cBuckets-1))-1);
+	}
+
+	{
+		CRollingHistogram h;
+		for (int i=0; i<54; ++i) h.Add(5);
+		for (int i=0; i<10; ++i) h.Add(5000);
+		CHECK(h.Count()==CRollingHistogram::cWindow);
+		CHECK(h.Percentile(0.5)==7);
+		CHECK(h.Percentile(0.8)==7);
+		CHECK(h.Percentile(0.9)==8191);
+
+		// Only the last cWindow samples count.
+		for (int i=0; i<CRollingHistogram::cWindow-10; ++i) h.Add(5000);
+		CHECK(h.Count()==CRollingHistogram::cWindow);
+		CHECK(h.Percentile(0.01)==8191);
+		h.Add(5);
+		CHECK(h.Last()==5);
+		CHECK(h.Percentile(0.01)==7);
+	}
+
+	{
+		CRenderStats stats;
+		CHECK(stats.Summary().empty());
+
+		markdown::Timings t;
+		t.read=1000;
+		t.spans=2500;
+		stats.Add(t);
+		stats.Add(CRenderStats::cEncode, 300);
+		CHECK(stats.Get(CRenderStats::cRead).Last()==1000);
+		CHECK(stats.Get(CRenderStats::cSpans).Last()==2500);
+		CHECK(stats.Get(CRenderStats::cWrite).Count()==1);
+		CHECK(stats.Get(CRenderStats::cFetch).Count()==0);
+
+		// Stages with no samples are left out; the rest are in stage order.
+		std::wstring summary=stats.Summary();
+		CHECK(!contains(summary, L"fetch"));
+		CHECK(summary.find(L"read 1.0 (p90 1.0) ms | ")==0);
+		CHECK(contains(summary, L"spans 2.5 (p90 4.1) ms"));
+		CHECK(contains(summary, L"encode 0.3 (p90 0.5) ms"));
+		CHECK(summary.find(L"spans")<summary.find(L"encode"));
+	}
+
+	if (failures==0) std::cout << "all passed\n";
+	return (failures==0 ? 0 : 1);
+}
@@ -0,0 +1,130 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+// stream-feed: checks that a document streamed with feed() and finish()
+// gives the same HTML as read() and write(), whatever the size of the pieces
+// it's fed in and whatever the line breaks, and that a reference that's
+// never defined only holds the output back as far as the stream policy
+// allows.
+
+#include "markdown.h"
+#include "corpus.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+
+namespace {
+
+const size_t cPieceSizes[]={ 1, 7, 4096 };
+const char *cLineBreaks[]={ "\n", "\r\n", "\n\r" };
+const char *cLineBreakNames[]={ "LF", "CRLF", "LF-CR" };
+const unsigned cDocuments=12, cBlocksStep=25, cLargeBlocks=3000;
+const size_t cSicParagraphs=20000;
+
+int failures=0;
+
+std::string withBreaks(const std::string& source, const std::string& lineBreak) {
+	std::string r;
+	for (size_t i=0; i<source.size(); ++i) {
+		if (source[i]=='\n') r+=lineBreak;
+		else r+=source[i];
+	}
+	return r;
+}
+
+std::string serial(const std::string& source) {
+	markdown::Document doc;
+	doc.read(source);
+	std::ostringstream out;
+	doc.write(out);
+	return out.str();
+}
+
+// All of the HTML, and how much of it was out before finish().
+std::string streamed(const std::string& source, size_t piece, const
+	markdown::StreamPolicy& policy, size_t *beforeFinish=0)
+{
+	markdown::Document doc;
+	doc.streamPolicy(policy);
+	std::ostringstream out;
+	for (size_t at=0; at<source.size(); at+=piece)
+		doc.feed(out, source.substr(at, piece));
+	if (beforeFinish!=0) *beforeFinish=out.str().size();
+	doc.finish(out);
+	return out.str();
+}
+
+void check(const std::string& name, const std::string& source, size_t piece,
+	const markdown::StreamPolicy& policy)
+{
+	std::string wanted=serial(source), got=streamed(source, piece, policy);
+	if (got==wanted) return;
+
+	size_t at=std::mismatch(wanted.begin(), wanted.begin()+std::min(
+		wanted.size(), got.size()), got.begin()).first-wanted.begin();
+	size_t from=(at>40 ? at-40 : 0);
+	std::cerr << name << ", pieces of " << piece << ": differs at byte " << at
+		<< "\n  read:   " << wanted.substr(from, 80) << "\n  stream: "
+		<< got.substr(from, 80) << '\n';
+	++failures;
+}
+
+} // namespace
+
+int main() {
+	markdown::StreamPolicy unlimited, byDefault;
+	unlimited.maxDeferredLines=0;
+	size_t checked=0;
+
+	for (size_t b=0; b<sizeof(cLineBreaks)/sizeof(cLineBreaks[0]); ++b) {
+		for (unsigned d=0; d<=cDocuments; ++d) {
+			const bool large=(d==cDocuments);
+			std::ostringstream name;
+			name << cLineBreakNames[b] << (large ? " large" : " small ") <<
+				(large ? "" : boost::lexical_cast<std::string>(d+1));
+			const std::string source=withBreaks(corpus::generate(200+d, large ?
+				cLargeBlocks : (d+1)*cBlocksStep), cLineBreaks[b]);
+
+			for (size_t p=0; p<sizeof(cPieceSizes)/sizeof(cPieceSizes[0]); ++p) {
+				// A byte at a time is too slow for the large one.
+				if (large && cPieceSizes[p]==1) continue;
+				check(name.str(), source, cPieceSizes[p], unlimited);
+				// The generated references are defined soon enough for the
+				// default limit not to matter.
+				check(name.str()+" (default policy)", source, cPieceSizes[p],
+					byDefault);
+				checked+=2;
+			}
+		}
+	}
+
+	// A bracketed phrase with no definition at the top, and a long document
+	// after it: by default that doesn't hold up everything until the end.
+	std::ostringstream sic;
+	sic << "Intro [sic] text.\n\n";
+	for (size_t i=0; i<cSicParagraphs; ++i) sic << "Paragraph " << i << ".\n\n";
+	size_t before=0;
+	std::string all=streamed(sic.str(), 4096, byDefault, &before);
+	if (before==0 || all!=serial(sic.str())) {
+		std::cerr << "[sic]: " << before << " of " << all.size() << " bytes "
+			"before finish(), with the default policy\n";
+		++failures;
+	}
+	// Unless asked to.
+	streamed(sic.str(), 4096, unlimited, &before);
+	if (before!=0) {
+		std::cerr << "[sic]: " << before << " bytes before finish(), with no "
+			"limit\n";
+		++failures;
+	}
+	checked+=2;
+
+	std::cout << checked-failures << " of " << checked << " checks passed\n";
+	return (failures==0 ? 0 : 1);
+}
@@ -0,0 +1,102 @@
+
+/*
+	Released under the MIT License.
+	See the provided LICENSE.TXT file for details.
+*/
+
+#ifndef MARKDOWN_TESTS_STUB_HOST_H_INCLUDED
+#define MARKDOWN_TESTS_STUB_HOST_H_INCLUDED
+
+#include "PreviewPipeline.h"
+#include "Scintilla.h"
+
+#include <string>
+#include <algorithm>
+
+#include <boost/chrono.hpp>
+
+// Stand-ins for the editor and the browser, so CPreviewPipeline can be
+// driven without Notepad++: the buffer is a string that the test edits, and
+// the sink just counts what it's sent and notes when.
+namespace stub {
+
+typedef boost::chrono::steady_clock Clock;
+
+class Buffer: public IEditorBuffer {
+	public:
+	Buffer(): mCodePage(SC_CP_UTF8), mCaret(0), mCaretLine(0), mScreenLines(50)
+		{ }
+
+	virtual void GetText(std::string& text) { text.assign(mText); }
+	virtual int GetCodePage() { return mCodePage; }
+	virtual void GetVisibleLines(size_t& first, size_t& last) {
+		first=(mCaretLine>mScreenLines/2 ? mCaretLine-mScreenLines/2 : 0);
+		last=first+mScreenLines-1;
+	}
+
+	std::string& text() { return mText; }
+	void codePage(int c) { mCodePage=c; }
+
+	// Edits at the caret, keeping the screen around it as an editor would.
+	void caret(size_t offset) {
+		mCaret=std::min(offset, mText.size());
+		mCaretLine=std::count(mText.begin(), mText.begin()+mCaret, '\n');
+	}
+	size_t caret() const { return mCaret; }
+	void type(char c) {
+		mText.insert(mText.begin()+mCaret, c);
+		++mCaret;
+		if (c=='\n') ++mCaretLine;
+	}
+	void backspace() {
+		if (mCaret==0) return;
+		--mCaret;
+		if (mText[mCaret]=='\n') --mCaretLine;
+		mText.erase(mCaret, 1);
+	}
+
+	private:
+	std::string mText;
+	int mCodePage;
+	size_t mCaret, mCaretLine, mScreenLines;
+};
+
+class Sink: public IPreviewSink {
+	public:
+	Sink(): bodies(0), blocks(0), scrolls(0), statuses(0), chars(0),
+		mPublished(false) { }
+
+	virtual void SetBody(const std::wstring& html) { ++bodies; body=html;
+		_published(html); }
+	virtual void SetBlock(size_t, const std::wstring& html) { ++blocks;
+		_published(html); }
+	virtual void ScrollToBlock(size_t) { ++scrolls; }
+	virtual void SetStatus(const std::wstring&) { ++statuses; }
+
+	// Whether anything has been published since the last call, and if so,
+	// when the first of it was.
+	bool published(Clock::time_point& at) {
+		if (!mPublished) return false;
+		at=mFirst;
+		mPublished=false;
+		return true;
+	}
+
+	unsigned long bodies, blocks, scrolls, statuses;
+	unsigned long long chars;
+	std::wstring body; // The last one
+
+	private:
+	void _published(const std::wstring& html) {
+		chars+=html.size();
+		if (!mPublished) mFirst=Clock::now();
+		mPublished=true;
+	}
+
+	bool mPublished;
+	Clock::time_point mFirst;
+};
+
+} // namespace stub
+
+#endif // MARKDOWN_TESTS_STUB_HOST_H_INCLUDED